@@ -0,0 +1,89 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "rt.h"
+
+#include <utility>
+
+class aabb {
+    public:
+        // The default box is empty, so it can be grown with expand().
+        aabb() : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity) {}
+        aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+        point3 min() const { return minimum; }
+        point3 max() const { return maximum; }
+
+        bool hit(const ray& r, real t_min, real t_max) const;
+
+        // Slab test with a precomputed reciprocal ray direction.
+        bool hit(const point3& origin, const vec3& inv_dir, real t_min, real t_max) const {
+            for (int a = 0; a < 3; a++) {
+                auto t0 = (minimum[a] - origin[a]) * inv_dir[a];
+                auto t1 = (maximum[a] - origin[a]) * inv_dir[a];
+                if (inv_dir[a] < 0.0)
+                    std::swap(t0, t1);
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max < t_min)
+                    return false;
+            }
+            return true;
+        }
+
+        // Plain comparisons compile to min/max instructions, where fmin and
+        // fmax stay library calls; bvh builds spend most of their time here.
+        void expand(const point3& p) {
+            for (int a = 0; a < 3; a++) {
+                minimum[a] = p[a] < minimum[a] ? p[a] : minimum[a];
+                maximum[a] = p[a] > maximum[a] ? p[a] : maximum[a];
+            }
+        }
+
+        // Growing by an empty box leaves the box as it is.
+        void expand(const aabb& box) {
+            for (int a = 0; a < 3; a++) {
+                minimum[a] = box.minimum[a] < minimum[a] ? box.minimum[a] : minimum[a];
+                maximum[a] = box.maximum[a] > maximum[a] ? box.maximum[a] : maximum[a];
+            }
+        }
+
+        bool empty() const {
+            return minimum.x() > maximum.x();
+        }
+
+        point3 centroid() const {
+            return 0.5 * (minimum + maximum);
+        }
+
+        real surface_area() const {
+            if (empty())
+                return 0;
+            vec3 d = maximum - minimum;
+            return 2.0 * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+        }
+
+        int longest_axis() const {
+            vec3 d = maximum - minimum;
+            if (d.x() > d.y() && d.x() > d.z())
+                return 0;
+            return d.y() > d.z() ? 1 : 2;
+        }
+
+    public:
+        point3 minimum;
+        point3 maximum;
+};
+
+bool aabb::hit(const ray& r, real t_min, real t_max) const {
+    vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    return hit(r.origin(), inv_dir, t_min, t_max);
+}
+
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+    aabb box = box0;
+    box.expand(box1);
+    return box;
+}
+
+#endif
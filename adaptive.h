@@ -0,0 +1,135 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include "rt.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+// Per-pixel running estimate of the mean and variance of the sample
+// luminance (Welford's update), used to decide when a pixel has converged.
+class adaptive_sampler {
+    public:
+        adaptive_sampler(int w, int h, double max_error, int budget_per_pixel)
+            : width(w), height(h), threshold(max_error),
+              min_samples(std::max(2, std::min(16, budget_per_pixel / 2))),
+              pass_samples(std::max(1, std::min(8, budget_per_pixel / 4))),
+              max_samples(4 * budget_per_pixel),
+              budget(static_cast<long long>(w) * h * budget_per_pixel),
+              spent(0), passes(0),
+              samples(w*h, 0), scheduled(w*h, 0), mean(w*h, 0.0), m2(w*h, 0.0) {}
+
+        // Chooses how many samples every pixel takes in the next pass and
+        // returns false once there is nothing left to do. The first pass gives
+        // every pixel min_samples; later passes give pass_samples to pixels
+        // that are still above the threshold, noisiest first while the budget
+        // left cannot cover them all.
+        bool plan_pass();
+
+        // Number of samples pixel (i, j) takes in the current pass, and the
+        // index of its first one.
+        int pass_count(int i, int j) const { return scheduled[j*width + i]; }
+        int sample_index(int i, int j) const { return samples[j*width + i]; }
+
+        void add(int i, int j, const color& c) {
+            int p = j*width + i;
+            double y = 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+            int n = ++samples[p];
+            double delta = y - mean[p];
+            mean[p] += delta / n;
+            m2[p] += delta * (y - mean[p]);
+        }
+
+        int sample_count(int i, int j) const { return samples[j*width + i]; }
+        long long total_samples() const { return spent; }
+        long long fixed_budget() const { return budget; }
+        int pass_total() const { return passes; }
+
+        // Standard error of the pixel as displayed. write_color() applies
+        // gamma 2, so an error in the linear mean shrinks by 2*sqrt(mean); this
+        // keeps dark pixels from soaking up the budget.
+        double display_error(int p) const {
+            int n = samples[p];
+            if (n < 2)
+                return infinity;
+            double variance = m2[p] / (n - 1);
+            return sqrt(variance / n) / (2 * sqrt(fmax(mean[p], 0.0001)));
+        }
+
+        // Writes the number of samples each pixel took as a grayscale PGM,
+        // scaled so that the busiest pixel is white.
+        bool write_samples_map(const char* path) const;
+
+    public:
+        int width;
+        int height;
+        double threshold;
+        int min_samples;
+        int pass_samples;
+        int max_samples;
+
+    private:
+        long long budget;
+        long long spent;
+        int passes;
+        std::vector<int> samples;
+        std::vector<int> scheduled;
+        std::vector<double> mean;
+        std::vector<double> m2;
+};
+
+bool adaptive_sampler::plan_pass() {
+    int pixels = width * height;
+    long long remaining = budget - spent;
+    long long planned = 0;
+
+    if (passes == 0) {
+        std::fill(scheduled.begin(), scheduled.end(), min_samples);
+        planned = static_cast<long long>(pixels) * min_samples;
+    } else {
+        std::vector<std::pair<double, int>> noisy;
+        for (int p = 0; p < pixels; ++p) {
+            scheduled[p] = 0;
+            double error = display_error(p);
+            if (samples[p] < max_samples && error > threshold)
+                noisy.push_back(std::make_pair(error, p));
+        }
+
+        long long affordable = remaining / pass_samples;
+        if (static_cast<long long>(noisy.size()) > affordable) {
+            std::nth_element(noisy.begin(), noisy.begin() + affordable, noisy.end(),
+                             [](const std::pair<double, int>& a, const std::pair<double, int>& b) {
+                                 return a.first > b.first;
+                             });
+            noisy.resize(affordable);
+        }
+        for (const auto& entry : noisy) {
+            int p = entry.second;
+            scheduled[p] = std::min(pass_samples, max_samples - samples[p]);
+            planned += scheduled[p];
+        }
+    }
+
+    if (planned == 0)
+        return false;
+    spent += planned;
+    passes++;
+    return true;
+}
+
+bool adaptive_sampler::write_samples_map(const char* path) const {
+    FILE* out = fopen(path, "w");
+    if (!out)
+        return false;
+
+    int busiest = std::max(1, *std::max_element(samples.begin(), samples.end()));
+    fprintf(out, "P2\n%d %d\n255\n", width, height);
+    for (int j = height-1; j >= 0; --j) {
+        for (int i = 0; i < width; ++i)
+            fprintf(out, "%d\n", 255 * samples[j*width + i] / busiest);
+    }
+    return fclose(out) == 0;
+}
+
+#endif
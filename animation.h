@@ -0,0 +1,141 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "rt.h"
+
+#include "instance.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Placement of an animated object at a keyframe: scaled, then rotated around
+// an axis through the origin, then translated.
+struct transform_key {
+    int frame;
+    vec3 translation;
+    vec3 axis;
+    double degrees;
+    double scale;
+
+    transform to_world() const {
+        return transform::translate(translation) * transform::rotate(axis, degrees) * transform::scale(scale);
+    }
+};
+
+// The camera at a keyframe; the rest of it stays as the scene describes.
+struct camera_key {
+    int frame;
+    point3 lookfrom;
+    point3 lookat;
+};
+
+// Finds the keys around frame in keys, sorted by frame: on return the value
+// at frame is keys[a] blended with keys[b] by t in [0,1]. Before the first key
+// and after the last the nearest key holds.
+template <typename Key>
+void bracket_keys(const std::vector<Key>& keys, double frame, size_t& a, size_t& b, double& t) {
+    b = 0;
+    while (b < keys.size() && keys[b].frame <= frame)
+        ++b;
+    if (b == 0) {
+        a = 0;
+        t = 0;
+    } else if (b == keys.size()) {
+        a = b = keys.size() - 1;
+        t = 0;
+    } else {
+        a = b - 1;
+        t = (frame - keys[a].frame) / (keys[b].frame - keys[a].frame);
+    }
+}
+
+// An object of the world placed by an instance whose transform follows its
+// keys. Translation, rotation axis and angle, and scale are each interpolated
+// linearly, so keys that share an axis turn the object evenly between them.
+struct animated_object {
+    shared_ptr<instance> placement;
+    std::vector<transform_key> keys;
+
+    void set_frame(double frame) const {
+        size_t a, b;
+        double t;
+        bracket_keys(keys, frame, a, b, t);
+        const transform_key& k0 = keys[a];
+        const transform_key& k1 = keys[b];
+        transform_key k;
+        k.frame = 0;
+        k.translation = (1-t) * k0.translation + t * k1.translation;
+        k.axis = (1-t) * k0.axis + t * k1.axis;
+        k.degrees = (1-t) * k0.degrees + t * k1.degrees;
+        k.scale = (1-t) * k0.scale + t * k1.scale;
+        if (k.axis.length_squared() == 0) {
+            k.axis = vec3(0, 1, 0);
+            k.degrees = 0;
+        }
+        placement->set_transform(k.to_world());
+    }
+};
+
+// Keyframes of a scene over the frames [first_frame, last_frame]; empty for a
+// still scene.
+struct scene_animation {
+    scene_animation() : first_frame(0), last_frame(-1) {}
+
+    bool empty() const { return last_frame < first_frame; }
+
+    // Moves every animated object to its place at frame.
+    void set_frame(double frame) const {
+        for (const animated_object& object : objects)
+            object.set_frame(frame);
+    }
+
+    // Sets lookfrom and lookat to the camera at frame, leaving them as they
+    // are if the camera has no keys.
+    void camera_at(double frame, point3& lookfrom, point3& lookat) const {
+        if (camera_keys.empty())
+            return;
+        size_t a, b;
+        double t;
+        bracket_keys(camera_keys, frame, a, b, t);
+        lookfrom = (1-t) * camera_keys[a].lookfrom + t * camera_keys[b].lookfrom;
+        lookat = (1-t) * camera_keys[a].lookat + t * camera_keys[b].lookat;
+    }
+
+    int first_frame;
+    int last_frame;
+    std::vector<camera_key> camera_keys;
+    std::vector<animated_object> objects;
+};
+
+// Path of a frame's image: pattern with its one printf conversion of an int,
+// such as %d or %04d, replaced by the frame number. Returns false if pattern
+// does not hold exactly one such conversion.
+bool frame_path(const char* pattern, int frame, std::string& path) {
+    int conversions = 0;
+    for (const char* c = pattern; *c; ++c) {
+        if (*c != '%')
+            continue;
+        if (c[1] == '%') {
+            ++c;
+            continue;
+        }
+        do
+            ++c;
+        while (*c == '0' || *c == '-' || *c == '+' || *c == ' ' || (*c >= '1' && *c <= '9'));
+        if (*c != 'd')
+            return false;
+        ++conversions;
+    }
+    if (conversions != 1)
+        return false;
+
+    char buffer[4096];
+    int n = snprintf(buffer, sizeof(buffer), pattern, frame);
+    if (n < 0 || n >= static_cast<int>(sizeof(buffer)))
+        return false;
+    path = buffer;
+    return true;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include "rt.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "material.h"
+#include "render.h"
+
+// Auxiliary buffers (AOVs) of the first surface seen through each pixel: its
+// albedo, its shading normal, its distance from the camera and the light it
+// emits. Like the image, they hold sums over samples, here the first
+// `samples` camera rays of each pixel, which are the same rays the image's
+// first samples start from. Rays that leave the scene add the sky as albedo
+// and nothing to the other buffers.
+struct aov_buffers {
+    aov_buffers(int w, int h) : albedo(w, h), normal(w, h), depth(w, h), emission(w, h), samples(0) {}
+
+    framebuffer albedo;
+    framebuffer normal;
+    framebuffer depth;      // the same distance in all three channels
+    framebuffer emission;
+    int samples;
+};
+
+// Color of a material as the albedo buffer records it: the attenuation of the
+// built-in kinds, and none for lights, which only emit. Other materials count
+// as white.
+inline color aov_albedo(const material* m) {
+    switch (m->kind) {
+        case material_kind::lambertian:
+            return static_cast<const lambertian*>(m)->albedo;
+        case material_kind::metal:
+            return static_cast<const metal*>(m)->albedo;
+        case material_kind::dielectric:
+            return static_cast<const dielectric*>(m)->albedo;
+        case material_kind::light:
+            return color(0, 0, 0);
+        default:
+            return color(1, 1, 1);
+    }
+}
+
+// Fills aov with samples camera rays per pixel of the image settings
+// describes, tracing only their first hits. Returns the number of rays.
+template <typename World>
+uint64_t render_aovs(aov_buffers& aov, const World& world, const camera& cam, const render_settings& settings,
+                     int samples) {
+    aov.samples = samples;
+    return render_tile_blocks(aov.albedo, settings.threads, settings.tile_size, [&](int, const tile& t) {
+        for (int j = t.y0; j < t.y1; ++j)
+            for (int i = t.x0; i < t.x1; ++i) {
+                color albedo(0, 0, 0), emission(0, 0, 0);
+                vec3 normal(0, 0, 0);
+                double depth = 0;
+                for (int s = 0; s < samples; ++s) {
+                    rng gen;
+                    ray r = camera_ray(cam, aov.albedo, settings.seed, settings.sequence, i, j, s, gen);
+                    hit_record rec;
+                    ++rays_traced;
+                    if (world.hit(r, hit_epsilon, infinity, rec)) {
+                        albedo += aov_albedo(rec.mat_ptr);
+                        normal += rec.normal;
+                        depth += rec.t * r.direction().length();
+                        emission += rec.mat_ptr->emitted();
+                    } else {
+                        albedo += background(r);
+                    }
+                }
+                aov.albedo.at(i, j) = albedo;
+                aov.normal.at(i, j) = normal;
+                aov.depth.at(i, j) = color(depth, depth, depth);
+                aov.emission.at(i, j) = emission;
+            }
+    });
+}
+
+#endif
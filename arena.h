@@ -0,0 +1,121 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "rt.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator for the objects of a scene. Objects are placed one after
+// another in large blocks, in the order they are created, and all of them
+// are destroyed and their blocks freed together when the arena goes away;
+// there is no freeing of single objects.
+//
+// make() hands out shared_ptrs that share the arena's own reference count
+// instead of one control block per object, so they fit the shared_ptr
+// interfaces of hittable_list and bvh and keep the arena alive while any of
+// them is held; the arena must itself be owned by a shared_ptr. create()
+// returns a plain pointer for objects the caller keeps track of otherwise.
+//
+// Objects that hold such shared_ptrs, like a bvh, an instance or a
+// hittable_list, must not be placed in the arena themselves: they would
+// keep their own arena alive, a cycle that is never freed. Make them with
+// make_shared instead.
+class scene_arena : public std::enable_shared_from_this<scene_arena> {
+    public:
+        explicit scene_arena(size_t block_size = 1 << 20) : block_size(block_size), next(nullptr), end(nullptr),
+                                                            used(0), reserved(0) {}
+        ~scene_arena();
+
+        scene_arena(const scene_arena&) = delete;
+        scene_arena& operator=(const scene_arena&) = delete;
+
+        template <typename T, typename... Args>
+        T* create(Args&&... args);
+
+        template <typename T, typename... Args>
+        shared_ptr<T> make(Args&&... args) {
+            return shared_ptr<T>(shared_from_this(), create<T>(std::forward<Args>(args)...));
+        }
+
+        size_t bytes_used() const { return used; }          // by the objects
+        size_t bytes_reserved() const { return reserved; }  // by the blocks
+
+    private:
+        void* allocate(size_t size, size_t alignment);
+
+        static char* align(char* p, size_t alignment) {
+            return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~(alignment - 1));
+        }
+
+        template <typename T>
+        static void destroy(void* p) { static_cast<T*>(p)->~T(); }
+
+        // Objects of one type created back to back, destroyed as a run.
+        struct destructor_run {
+            void (*destroy)(void*);
+            char* first;
+            size_t size;
+            size_t count;
+        };
+
+        size_t block_size;
+        char* next;             // free space of the current block
+        char* end;
+        size_t used;
+        size_t reserved;
+        std::vector<char*> blocks;
+        std::vector<destructor_run> runs;
+};
+
+scene_arena::~scene_arena() {
+    for (auto run = runs.rbegin(); run != runs.rend(); ++run)
+        for (size_t k = run->count; k-- > 0; )
+            run->destroy(run->first + k * run->size);
+    for (char* block : blocks)
+        ::operator delete(block);
+}
+
+void* scene_arena::allocate(size_t size, size_t alignment) {
+    used += size;
+    char* p = align(next, alignment);
+    if (next && p + size <= end) {
+        next = p + size;
+        return p;
+    }
+
+    // An object too large for a block gets one of its own, and the current
+    // block stays open for the objects after it.
+    size_t bytes = std::max(block_size, size + alignment);
+    char* block = static_cast<char*>(::operator new(bytes));
+    blocks.push_back(block);
+    reserved += bytes;
+    p = align(block, alignment);
+    if (bytes == block_size) {
+        next = p + size;
+        end = block + bytes;
+    }
+    return p;
+}
+
+template <typename T, typename... Args>
+T* scene_arena::create(Args&&... args) {
+    T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value) {
+        char* p = reinterpret_cast<char*>(object);
+        destructor_run* last = runs.empty() ? nullptr : &runs.back();
+        if (last && last->destroy == &destroy<T> && last->first + last->count * sizeof(T) == p)
+            last->count++;
+        else
+            runs.push_back(destructor_run{ &destroy<T>, p, sizeof(T), 1 });
+    }
+    return object;
+}
+
+#endif
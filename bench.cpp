@@ -0,0 +1,764 @@
+#include "rt.h"
+
+#include "builtin_scenes.h"
+#include "bvh.h"
+#include "camera.h"
+#include "color.h"
+#include "hittable_list.h"
+#include "integrator.h"
+#include "material.h"
+#include "rectangle.h"
+#include "render.h"
+#include "simd.h"
+#include "sphere.h"
+#include "triangle.h"
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Benchmarks for the primitive kernels and for whole renders of the built-in
+// scenes. Everything is seeded, so two runs trace the same rays and render the
+// same images; the image hash in the report tells a change in speed apart
+// from a change in the result. The report is written as JSON for comparing
+// runs, with a summary on stderr.
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Keeps the compiler from dropping the work being timed.
+volatile double bench_sink;
+
+struct kernel_result {
+    std::string name;
+    long long calls;
+    double ns_per_call;
+    double hit_rate;        // fraction of calls that hit, for intersections
+};
+
+struct scene_result {
+    int scene;
+    const char* name;
+    int width, height, samples;
+    uint64_t rays;
+    double seconds;
+    unsigned long long image_hash;
+};
+
+// Camera rays of one sample per pixel at full size, traced one by one and in
+// packets of the sizes in primary_packet_sizes.
+const int primary_modes = 4;
+const int primary_packet_sizes[primary_modes] = { 1, 4, 8, 16 };
+
+struct primary_result {
+    int scene;
+    const char* name;
+    int width, height;
+    double seconds[primary_modes];
+    double hit_rate;
+    bool same_hits;         // packets found the same hits as single rays
+};
+
+struct scaling_point {
+    int threads;
+    uint64_t rays;
+    double seconds;
+};
+
+// Construction of a large scene with each way of storing its objects.
+struct build_result {
+    const char* storage;
+    int primitives;
+    double build_seconds;   // objects, materials and the list of them
+    double scene_mb;        // resident memory they added
+    double bvh_seconds;
+    double bvh_mb;
+    double ns_per_ray;      // random rays through the bvh, one thread
+    double release_seconds;
+};
+
+// Best time per call over repeats runs of calls calls of f(k), which returns
+// whether call k counts as a hit. At least one call is made, so that the
+// report never holds a time or rate divided by zero.
+template <typename Fn>
+kernel_result time_kernel(const char* name, long long calls, int repeats, Fn f) {
+    calls = std::max(1LL, calls);
+    kernel_result result;
+    result.name = name;
+    result.calls = calls;
+    result.ns_per_call = infinity;
+    long long hits = 0;
+    for (int run = 0; run < repeats; ++run) {
+        hits = 0;
+        auto start = bench_clock::now();
+        for (long long k = 0; k < calls; ++k)
+            hits += f(k);
+        std::chrono::duration<double, std::nano> elapsed = bench_clock::now() - start;
+        result.ns_per_call = fmin(result.ns_per_call, elapsed.count() / calls);
+    }
+    result.hit_rate = double(hits) / calls;
+    return result;
+}
+
+// Rays from a shell of radius 3 around the origin aimed at points of the
+// cube [-1.5, 1.5]^3, so that a unit-sized primitive at the origin is hit
+// by part of them and missed by the rest.
+std::vector<ray> kernel_rays(int count, uint64_t seed) {
+    rng gen(seed, 0, 2);
+    std::vector<ray> rays;
+    for (int k = 0; k < count; ++k) {
+        point3 origin = 3.0 * random_unit_vector(gen);
+        point3 target = vec3::random(gen, -1.5, 1.5);
+        rays.push_back(ray(origin, target - origin));
+    }
+    return rays;
+}
+
+std::vector<kernel_result> bench_kernels(long long calls, int repeats, uint64_t seed) {
+    std::vector<kernel_result> results;
+    material_table materials;
+    const material* white = materials.make<lambertian>(color(0.5, 0.5, 0.5));
+
+    const int ray_count = 4096;
+    std::vector<ray> rays = kernel_rays(ray_count, seed);
+    auto intersect = [&](const char* name, const hittable& object, long long n) {
+        return time_kernel(name, n, repeats, [&](long long k) {
+            hit_record rec;
+            bool hit = object.hit(rays[k & (ray_count-1)], hit_epsilon, infinity, rec);
+            bench_sink = rec.t;
+            return hit;
+        });
+    };
+
+    sphere ball(point3(0, 0, 0), 1.0, white);
+    triangle tri(point3(-1, -1, 0), point3(1, -1, 0), point3(0, 1, 0.5), white);
+    rectangle rect(-1, 1, -1, 1, NONE, NONE, 3, 0, white);
+    results.push_back(intersect("sphere::hit", ball, calls));
+    results.push_back(intersect("triangle::hit", tri, calls));
+    results.push_back(intersect("rectangle::hit", rect, calls));
+
+    // The random scene's ~480 spheres, tested one by one and through a BVH,
+    // with the camera rays of the scene.
+    scene_description scene;
+    rng scene_gen(seed);
+    builtin_scene(0, materials, scene_gen, scene);
+    camera cam(scene.lookfrom, scene.lookat, vec3(0,1,0), scene.vfov, scene.aspect_ratio,
+               scene.aperture, scene.focus_dist);
+    rng gen(seed, 0, 3);
+    std::vector<ray> camera_rays;
+    for (int k = 0; k < ray_count; ++k)
+        camera_rays.push_back(cam.get_ray(random_double(gen), random_double(gen), gen));
+    bvh accel(scene.world);
+    auto intersect_scene = [&](const char* name, const hittable& world, long long n) {
+        return time_kernel(name, n, repeats, [&](long long k) {
+            hit_record rec;
+            bool hit = world.hit(camera_rays[k & (ray_count-1)], hit_epsilon, infinity, rec);
+            bench_sink = rec.t;
+            return hit;
+        });
+    };
+    results.push_back(intersect_scene("hittable_list::hit", scene.world, std::max(1LL, calls / 256)));
+    results.push_back(intersect_scene("bvh::hit", accel, std::max(1LL, calls / 4)));
+
+    // Shadow rays to a point light above the scene from the camera hits of a
+    // 64x64 grid of pixels, taken in 4x4 blocks as the wavefront integrator
+    // queues them: as a closest-hit query, as an any-hit query, and as
+    // any-hit queries traced in packets of consecutive rays (amortized per
+    // ray).
+    std::vector<ray> shadow_rays;
+    std::vector<real> shadow_t_max;
+    for (int block = 0; block < 256; ++block)
+        for (int p = 0; p < 16; ++p) {
+            int i = (block % 16) * 4 + p % 4, j = (block / 16) * 4 + p / 4;
+            ray r = cam.get_ray((i + 0.5) / 64, (j + 0.5) / 64, gen);
+            hit_record rec;
+            if (accel.hit(r, hit_epsilon, infinity, rec)) {
+                shadow_rays.push_back(ray(rec.p, point3(0, 20, 0) - rec.p));
+                shadow_t_max.push_back(1 - hit_epsilon);
+            }
+        }
+    const size_t shadow_count = shadow_rays.size() & ~size_t(max_packet_size - 1);
+    // A scene the grid misses entirely leaves no packet of shadow rays to
+    // time; the shadow kernels are then left out of the report.
+    if (shadow_count > 0) {
+        const long long shadow_calls = std::max(1LL, calls / 4);
+        results.push_back(time_kernel("bvh::hit (shadow)", shadow_calls, repeats, [&](long long k) {
+            size_t i = k % shadow_count;
+            hit_record rec;
+            bool hit = accel.hit(shadow_rays[i], hit_epsilon, shadow_t_max[i], rec);
+            bench_sink = rec.t;
+            return hit;
+        }));
+        results.push_back(time_kernel("bvh::occluded", shadow_calls, repeats, [&](long long k) {
+            size_t i = k % shadow_count;
+            return accel.occluded(shadow_rays[i], hit_epsilon, shadow_t_max[i]);
+        }));
+        char blocked[max_packet_size];
+        results.push_back(time_kernel("occluded_batch", shadow_calls, repeats, [&](long long k) {
+            size_t i = k % shadow_count;
+            if (i % max_packet_size == 0)
+                occluded_batch(accel, &shadow_rays[i], &shadow_t_max[i], max_packet_size, hit_epsilon, blocked);
+            return blocked[i % max_packet_size] != 0;
+        }));
+    }
+
+    results.push_back(time_kernel("camera::get_ray", calls, repeats, [&](long long) {
+        ray r = cam.get_ray(random_double(gen), random_double(gen), gen);
+        bench_sink = r.direction().x();
+        return false;
+    }));
+    results.push_back(time_kernel("random_double", calls, repeats, [&](long long) {
+        bench_sink = random_double(gen);
+        return false;
+    }));
+    // A sample's stream is restarted every 64 draws, about a path's worth.
+    rng sobol_gen;
+    results.push_back(time_kernel("random_double (sobol)", calls, repeats, [&](long long k) {
+        if (k % 64 == 0)
+            sobol_gen = rng(seed, 0, static_cast<uint64_t>(k / 64), sample_sequence::sobol);
+        bench_sink = random_double(sobol_gen);
+        return false;
+    }));
+    results.push_back(time_kernel("random_in_unit_sphere", calls, repeats, [&](long long) {
+        bench_sink = random_in_unit_sphere(gen).x();
+        return false;
+    }));
+    results.push_back(time_kernel("random_unit_vector", calls, repeats, [&](long long) {
+        bench_sink = random_unit_vector(gen).x();
+        return false;
+    }));
+    results.push_back(time_kernel("random_in_hemisphere", calls, repeats, [&](long long) {
+        bench_sink = random_in_hemisphere(vec3(0, 1, 0), gen).x();
+        return false;
+    }));
+    results.push_back(time_kernel("random_in_unit_disk", calls, repeats, [&](long long) {
+        bench_sink = random_in_unit_disk(gen).x();
+        return false;
+    }));
+    return results;
+}
+
+// FNV-1a over the tone-mapped pixels, as they would be written to a file.
+unsigned long long hash_image(const framebuffer& image, int samples) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (const color& c : image.pixels) {
+        int rgb[3];
+        tone_map(c, samples, rgb);
+        for (int k = 0; k < 3; ++k)
+            hash = (hash ^ static_cast<unsigned>(rgb[k])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// A built-in scene prepared for rendering at a fraction of its size.
+struct bench_scene {
+    bench_scene(int type, int scale, uint64_t seed) {
+        rng gen(seed);
+        builtin_scene(type, materials, gen, description);
+        width = std::max(1, description.image_width / scale);
+        height = std::max(1, static_cast<int>(width / description.aspect_ratio));
+        cam = camera(description.lookfrom, description.lookat, vec3(0,1,0), description.vfov,
+                     description.aspect_ratio, description.aperture, description.focus_dist);
+        accel = make_shared<bvh>(description.world);
+    }
+
+    // Renders the scene and returns the time taken; the image is left in image.
+    double render(const render_settings& settings, framebuffer& image, uint64_t& rays) const {
+        black_background = description.black_background;
+        image = framebuffer(width, height);
+        auto start = bench_clock::now();
+        rays = render_image(image, *accel, cam, settings);
+        std::chrono::duration<double> elapsed = bench_clock::now() - start;
+        return elapsed.count();
+    }
+
+    material_table materials;
+    scene_description description;
+    camera cam;
+    shared_ptr<bvh> accel;
+    int width, height;
+};
+
+static const char* scene_names[builtin_scene_count] = { "random", "cornell", "triangle", "instance", "mesh" };
+
+std::vector<scene_result> bench_scenes(const std::vector<int>& scenes, int scale, render_settings settings,
+                                       int repeats) {
+    std::vector<scene_result> results;
+    for (int type : scenes) {
+        scene_result result;
+        std::weak_ptr<scene_arena> arena;
+        {
+            bench_scene scene(type, scale, settings.seed);
+            arena = scene.description.arena;
+            result.scene = type;
+            result.name = scene_names[type];
+            result.width = scene.width;
+            result.height = scene.height;
+            result.samples = settings.samples_per_pixel;
+            result.seconds = infinity;
+            framebuffer image(1, 1);
+            for (int run = 0; run < repeats; ++run)
+                result.seconds = fmin(result.seconds, scene.render(settings, image, result.rays));
+            result.image_hash = hash_image(image, settings.samples_per_pixel);
+        }
+        // Dropping a scene frees its arena. An arena still alive here is
+        // kept by an object inside it that holds a pointer from make().
+        if (!arena.expired()) {
+            fprintf(stderr, "%s scene: arena still referenced %ld times after teardown\n",
+                    result.name, arena.use_count());
+            exit(1);
+        }
+        results.push_back(result);
+    }
+    return results;
+}
+
+// Traces the camera rays of a frame on the calling thread, so that the time
+// is spent in traversal and intersection only.
+primary_result bench_primary(int type, int repeats, uint64_t seed) {
+    bench_scene scene(type, 1, seed);
+    primary_result result;
+    result.scene = type;
+    result.name = scene_names[type];
+    result.width = scene.width;
+    result.height = scene.height;
+    result.same_hits = true;
+
+    const int width = scene.width, height = scene.height;
+    framebuffer image(width, height);
+    std::vector<ray> rays(static_cast<size_t>(width) * height);
+    for (int j = 0; j < height; ++j)
+        for (int i = 0; i < width; ++i) {
+            rng gen;
+            rays[j*width + i] = camera_ray(scene.cam, image, seed, sample_sequence::independent, i, j, 0, gen);
+        }
+
+    const hittable& world = *scene.accel;
+    std::vector<real> reference, hit_t(rays.size());
+    ray_packet packet;
+    hit_record recs[max_packet_size];
+    int index[max_packet_size];
+    for (int mode = 0; mode < primary_modes; ++mode) {
+        const int size = primary_packet_sizes[mode];
+        const int block_width = size >= 8 ? 4 : 2;
+        const int block_height = size / block_width;
+        result.seconds[mode] = infinity;
+        for (int run = 0; run < repeats; ++run) {
+            auto start = bench_clock::now();
+            if (size == 1) {
+                for (size_t p = 0; p < rays.size(); ++p) {
+                    hit_record rec;
+                    hit_t[p] = world.hit(rays[p], hit_epsilon, infinity, rec) ? rec.t : infinity;
+                }
+            } else {
+                for (int y = 0; y < height; y += block_height)
+                    for (int x = 0; x < width; x += block_width) {
+                        packet.clear();
+                        for (int j = y; j < std::min(y + block_height, height); ++j)
+                            for (int i = x; i < std::min(x + block_width, width); ++i) {
+                                index[packet.count] = j*width + i;
+                                packet.add(rays[j*width + i]);
+                            }
+                        packet.prepare();
+                        int hits = world.hit_packet(packet, hit_epsilon, recs, packet.all());
+                        for (int k = 0; k < packet.count; ++k)
+                            hit_t[index[k]] = (hits >> k) & 1 ? recs[k].t : infinity;
+                    }
+            }
+            std::chrono::duration<double> elapsed = bench_clock::now() - start;
+            result.seconds[mode] = fmin(result.seconds[mode], elapsed.count());
+        }
+        if (mode == 0)
+            reference = hit_t;
+        else if (hit_t != reference)
+            result.same_hits = false;
+    }
+
+    size_t hits = 0;
+    for (real t : reference)
+        hits += t < infinity;
+    result.hit_rate = double(hits) / reference.size();
+    return result;
+}
+
+// Thread counts 1, 2, 4, ... up to and including max_threads.
+std::vector<scaling_point> bench_scaling(int type, int scale, render_settings settings, int max_threads,
+                                         int repeats) {
+    std::vector<scaling_point> points;
+    bench_scene scene(type, scale, settings.seed);
+    framebuffer image(1, 1);
+    for (int threads = 1; ; threads = std::min(2 * threads, max_threads)) {
+        settings.threads = threads;
+        scaling_point point;
+        point.threads = threads;
+        point.seconds = infinity;
+        for (int run = 0; run < repeats; ++run)
+            point.seconds = fmin(point.seconds, scene.render(settings, image, point.rays));
+        points.push_back(point);
+        if (threads == max_threads)
+            break;
+    }
+    return points;
+}
+
+// Every object and material in a heap allocation of its own, as the scenes
+// were built before scene_arena.
+struct heap_storage {
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) { return make_shared<T>(std::forward<Args>(args)...); }
+
+    template <typename T, typename... Args>
+    const material* make_material(Args&&... args) {
+        materials.push_back(std::unique_ptr<material>(new T(std::forward<Args>(args)...)));
+        return materials.back().get();
+    }
+
+    std::vector<std::unique_ptr<material>> materials;
+};
+
+// Objects in a scene_arena and materials in a material_table, as the scenes
+// are built now.
+struct arena_storage {
+    arena_storage() : arena(make_shared<scene_arena>()) {}
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) { return arena->make<T>(std::forward<Args>(args)...); }
+
+    template <typename T, typename... Args>
+    const material* make_material(Args&&... args) { return materials.make<T>(std::forward<Args>(args)...); }
+
+    shared_ptr<scene_arena> arena;
+    material_table materials;
+};
+
+// Resident memory of this process in bytes.
+double resident_bytes() {
+    long pages = 0, resident = 0;
+    FILE* in = fopen("/proc/self/statm", "r");
+    if (in) {
+        if (fscanf(in, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(in);
+    }
+    return double(resident) * sysconf(_SC_PAGESIZE);
+}
+
+// Builds n spheres and triangles scattered through a cube, each with a
+// material of its own as in the random scene, then a bvh over them, and
+// traces random rays through it.
+template <typename Storage>
+build_result bench_build_with(const char* name, int n, uint64_t seed) {
+    build_result result;
+    result.storage = name;
+    result.primitives = n;
+    rng gen(seed);
+    const double size = 2 * cbrt(double(n));
+
+    double base = resident_bytes();
+    auto start = bench_clock::now();
+    std::unique_ptr<Storage> storage(new Storage);
+    std::unique_ptr<hittable_list> world(new hittable_list);
+    for (int k = 0; k < n; ++k) {
+        point3 p(size * random_double(gen), size * random_double(gen), size * random_double(gen));
+        const material* m = storage->template make_material<lambertian>(color::random(gen));
+        if (k % 2)
+            world->add(storage->template make<sphere>(p, 0.5, m));
+        else
+            world->add(storage->template make<triangle>(p, p + random_unit_vector(gen), p + random_unit_vector(gen), m));
+    }
+    std::chrono::duration<double> elapsed = bench_clock::now() - start;
+    result.build_seconds = elapsed.count();
+    double built = resident_bytes();
+    result.scene_mb = (built - base) / 1048576.0;
+
+    start = bench_clock::now();
+    std::unique_ptr<bvh> accel(new bvh(*world));
+    elapsed = bench_clock::now() - start;
+    result.bvh_seconds = elapsed.count();
+    result.bvh_mb = (resident_bytes() - built) / 1048576.0;
+
+    const int rays = 200000;
+    std::vector<ray> probes;
+    for (int k = 0; k < rays; ++k)
+        probes.push_back(ray(point3(size * random_double(gen), size * random_double(gen), size * random_double(gen)),
+                             random_unit_vector(gen)));
+    double hits = 0;
+    start = bench_clock::now();
+    for (const ray& r : probes) {
+        hit_record rec;
+        if (accel->hit(r, hit_epsilon, infinity, rec))
+            hits += rec.t;
+    }
+    elapsed = bench_clock::now() - start;
+    bench_sink = hits;
+    result.ns_per_ray = elapsed.count() * 1e9 / rays;
+
+    start = bench_clock::now();
+    accel.reset();
+    world.reset();
+    storage.reset();
+    elapsed = bench_clock::now() - start;
+    result.release_seconds = elapsed.count();
+    return result;
+}
+
+// Runs bench_build_with() for each storage in a child process of its own, so
+// that memory freed by one does not make room for the next.
+std::vector<build_result> bench_build(int n, uint64_t seed) {
+    std::vector<build_result> results;
+    for (int storage = 0; storage < 2; ++storage) {
+        int fds[2];
+        if (pipe(fds) != 0)
+            break;
+        pid_t child = fork();
+        if (child == 0) {
+            close(fds[0]);
+            build_result result = storage == 0 ? bench_build_with<heap_storage>("heap", n, seed)
+                                               : bench_build_with<arena_storage>("arena", n, seed);
+            bool ok = write(fds[1], &result, sizeof(result)) == sizeof(result);
+            _exit(ok ? 0 : 1);
+        }
+        close(fds[1]);
+        build_result result;
+        bool ok = child > 0 && read(fds[0], &result, sizeof(result)) == sizeof(result);
+        close(fds[0]);
+        if (child > 0)
+            waitpid(child, NULL, 0);
+        if (ok)
+            results.push_back(result);
+    }
+    return results;
+}
+
+bool write_report(const char* path, const render_settings& settings, int scale, int scaling_scene,
+                  const std::vector<kernel_result>& kernels, const std::vector<scene_result>& scenes,
+                  const std::vector<primary_result>& primary, const std::vector<scaling_point>& scaling,
+                  const std::vector<build_result>& builds) {
+    FILE* out = fopen(path, "w");
+    if (!out)
+        return false;
+
+    const char* methods[] = { "split", "path", "wavefront" };
+    fprintf(out, "{\n");
+    fprintf(out, "  \"simd\": \"%s\",\n", SIMD_ISA);
+    fprintf(out, "  \"hardware_threads\": %d,\n", default_thread_count());
+    fprintf(out, "  \"seed\": %llu,\n", static_cast<unsigned long long>(settings.seed));
+    fprintf(out, "  \"integrator\": \"%s\",\n", methods[static_cast<int>(settings.method)]);
+    fprintf(out, "  \"samples_per_pixel\": %d,\n", settings.samples_per_pixel);
+    fprintf(out, "  \"max_depth\": %d,\n", settings.max_depth);
+    fprintf(out, "  \"packet_size\": %d,\n", settings.packet_size);
+    fprintf(out, "  \"scale\": %d,\n", scale);
+
+    fprintf(out, "  \"kernels\": [");
+    for (size_t k = 0; k < kernels.size(); ++k)
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"calls\": %lld, \"ns_per_call\": %.3f, \"hit_rate\": %.4f}",
+                k ? "," : "", kernels[k].name.c_str(), kernels[k].calls, kernels[k].ns_per_call,
+                kernels[k].hit_rate);
+    fprintf(out, "%s],\n", kernels.empty() ? "" : "\n  ");
+
+    fprintf(out, "  \"scenes\": [");
+    for (size_t k = 0; k < scenes.size(); ++k) {
+        const scene_result& s = scenes[k];
+        fprintf(out, "%s\n    {\"scene\": %d, \"name\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, "
+                     "\"rays\": %llu, \"seconds\": %.6f, \"mrays_per_second\": %.3f, \"ns_per_ray\": %.2f, "
+                     "\"image_hash\": \"%016llx\"}",
+                k ? "," : "", s.scene, s.name, s.width, s.height, settings.threads,
+                static_cast<unsigned long long>(s.rays), s.seconds, s.rays / s.seconds * 1e-6,
+                s.seconds * 1e9 / s.rays, s.image_hash);
+    }
+    fprintf(out, "%s],\n", scenes.empty() ? "" : "\n  ");
+
+    fprintf(out, "  \"primary\": [");
+    for (size_t k = 0; k < primary.size(); ++k) {
+        const primary_result& p = primary[k];
+        double rays = double(p.width) * p.height;
+        fprintf(out, "%s\n    {\"scene\": %d, \"name\": \"%s\", \"width\": %d, \"height\": %d, "
+                     "\"hit_rate\": %.4f, \"same_hits\": %s, \"modes\": [",
+                k ? "," : "", p.scene, p.name, p.width, p.height, p.hit_rate, p.same_hits ? "true" : "false");
+        for (int mode = 0; mode < primary_modes; ++mode)
+            fprintf(out, "%s{\"packet_size\": %d, \"seconds\": %.6f, \"mrays_per_second\": %.3f, "
+                         "\"speedup\": %.3f}",
+                    mode ? ", " : "", primary_packet_sizes[mode], p.seconds[mode], rays / p.seconds[mode] * 1e-6,
+                    p.seconds[0] / p.seconds[mode]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "%s],\n", primary.empty() ? "" : "\n  ");
+
+    fprintf(out, "  \"scaling\": {\"scene\": \"%s\", \"points\": [",
+            scaling.empty() ? "" : scene_names[scaling_scene]);
+    for (size_t k = 0; k < scaling.size(); ++k) {
+        const scaling_point& p = scaling[k];
+        double speedup = scaling[0].seconds / p.seconds;
+        fprintf(out, "%s\n    {\"threads\": %d, \"rays\": %llu, \"seconds\": %.6f, \"mrays_per_second\": %.3f, "
+                     "\"speedup\": %.3f, \"efficiency\": %.3f}",
+                k ? "," : "", p.threads, static_cast<unsigned long long>(p.rays), p.seconds,
+                p.rays / p.seconds * 1e-6, speedup, speedup / p.threads);
+    }
+    fprintf(out, "%s]},\n", scaling.empty() ? "" : "\n  ");
+
+    fprintf(out, "  \"build\": [");
+    for (size_t k = 0; k < builds.size(); ++k) {
+        const build_result& b = builds[k];
+        fprintf(out, "%s\n    {\"storage\": \"%s\", \"primitives\": %d, \"build_seconds\": %.6f, \"scene_mb\": %.2f, "
+                     "\"bvh_seconds\": %.6f, \"bvh_mb\": %.2f, \"ns_per_ray\": %.2f, \"release_seconds\": %.6f}",
+                k ? "," : "", b.storage, b.primitives, b.build_seconds, b.scene_mb, b.bvh_seconds, b.bvh_mb,
+                b.ns_per_ray, b.release_seconds);
+    }
+    fprintf(out, "%s]\n}\n", builds.empty() ? "" : "\n  ");
+    return fclose(out) == 0;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-o report.json] [-t threads] [-s samples_per_pixel] [--seed n] [--repeat n]\n"
+                    "          [--calls n] [--scale n] [--scenes 0,1,2,3] [--scaling-scene n] [--max-threads n]\n"
+                    "          [--integrator split|path|wavefront] [--packet 0|4|8|16] [--no-kernels] [--no-scenes]\n"
+                    "          [--no-primary] [--no-scaling] [--build-primitives n] [--no-build]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* output_path = "bench.json";
+    render_settings settings;
+    settings.method = integrator::split;
+    settings.first_sample = 0;
+    settings.samples_per_pixel = 4;
+    settings.max_depth = 50;
+    settings.threads = default_thread_count();
+    settings.tile_size = 32;
+    settings.packet_size = 16;
+    settings.lights = nullptr;
+    settings.seed = 0;
+    settings.sequence = sample_sequence::independent;
+    int repeats = 3;
+    long long calls = 4000000;
+    int scale = 4;
+    std::vector<int> scenes = { 0, 1, 2, 3 };
+    int scaling_scene = 0;
+    int max_threads = default_thread_count();
+    int build_primitives = 1000000;
+    bool run_kernels = true, run_scenes = true, run_primary = true, run_scaling = true, run_build = true;
+
+    for (int k = 1; k < argc; ++k) {
+        if (!strcmp(argv[k], "-o") && k+1 < argc)
+            output_path = argv[++k];
+        else if (!strcmp(argv[k], "-t") && k+1 < argc)
+            settings.threads = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "-s") && k+1 < argc)
+            settings.samples_per_pixel = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--seed") && k+1 < argc)
+            settings.seed = strtoull(argv[++k], NULL, 10);
+        else if (!strcmp(argv[k], "--repeat") && k+1 < argc)
+            repeats = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--calls") && k+1 < argc)
+            calls = atoll(argv[++k]);
+        else if (!strcmp(argv[k], "--scale") && k+1 < argc)
+            scale = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--scenes") && k+1 < argc) {
+            scenes.clear();
+            for (const char* p = argv[++k]; *p; ) {
+                char* end;
+                long type = strtol(p, &end, 10);
+                if (end == p || type < 0 || type >= builtin_scene_count)
+                    usage(argv[0]);
+                scenes.push_back(static_cast<int>(type));
+                p = *end == ',' ? end + 1 : end;
+            }
+        }
+        else if (!strcmp(argv[k], "--scaling-scene") && k+1 < argc)
+            scaling_scene = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--max-threads") && k+1 < argc)
+            max_threads = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--integrator") && k+1 < argc) {
+            const char* name = argv[++k];
+            if (!strcmp(name, "path"))
+                settings.method = integrator::path;
+            else if (!strcmp(name, "wavefront"))
+                settings.method = integrator::wavefront;
+            else if (strcmp(name, "split"))
+                usage(argv[0]);
+        }
+        else if (!strcmp(argv[k], "--packet") && k+1 < argc)
+            settings.packet_size = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--no-kernels"))
+            run_kernels = false;
+        else if (!strcmp(argv[k], "--no-scenes"))
+            run_scenes = false;
+        else if (!strcmp(argv[k], "--no-primary"))
+            run_primary = false;
+        else if (!strcmp(argv[k], "--no-scaling"))
+            run_scaling = false;
+        else if (!strcmp(argv[k], "--build-primitives") && k+1 < argc)
+            build_primitives = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--no-build"))
+            run_build = false;
+        else
+            usage(argv[0]);
+    }
+    if (settings.threads < 1 || settings.samples_per_pixel < 1 || repeats < 1 || calls < 1 || scale < 1
+        || max_threads < 1 || build_primitives < 1 || scaling_scene < 0 || scaling_scene >= builtin_scene_count
+        || (settings.packet_size != 0 && settings.packet_size != 4 && settings.packet_size != 8
+            && settings.packet_size != 16))
+        usage(argv[0]);
+    show_progress = false;
+
+    std::vector<kernel_result> kernels;
+    if (run_kernels) {
+        kernels = bench_kernels(calls, repeats, settings.seed);
+        for (const kernel_result& k : kernels)
+            fprintf(stderr, "%-24s %9.2f ns/call  (hit rate %.2f)\n", k.name.c_str(), k.ns_per_call, k.hit_rate);
+    }
+
+    std::vector<scene_result> scene_results;
+    if (run_scenes) {
+        scene_results = bench_scenes(scenes, scale, settings, repeats);
+        for (const scene_result& s : scene_results)
+            fprintf(stderr, "%-9s %4dx%-4d %d spp, %d threads: %llu rays in %.3f s (%.2f Mrays/s, %.1f ns/ray), hash %016llx\n",
+                    s.name, s.width, s.height, s.samples, settings.threads, static_cast<unsigned long long>(s.rays),
+                    s.seconds, s.rays / s.seconds * 1e-6, s.seconds * 1e9 / s.rays, s.image_hash);
+    }
+
+    std::vector<primary_result> primary;
+    if (run_primary) {
+        for (int type : scenes) {
+            primary.push_back(bench_primary(type, repeats, settings.seed));
+            const primary_result& p = primary.back();
+            double rays = double(p.width) * p.height;
+            fprintf(stderr, "%-9s %4dx%-4d camera rays: single %.2f Mrays/s", p.name, p.width, p.height,
+                    rays / p.seconds[0] * 1e-6);
+            for (int mode = 1; mode < primary_modes; ++mode)
+                fprintf(stderr, ", packets of %d %.2f (x%.2f)", primary_packet_sizes[mode],
+                        rays / p.seconds[mode] * 1e-6, p.seconds[0] / p.seconds[mode]);
+            fprintf(stderr, "%s\n", p.same_hits ? "" : "  (packets found different hits)");
+        }
+    }
+
+    std::vector<scaling_point> scaling;
+    if (run_scaling) {
+        scaling = bench_scaling(scaling_scene, scale, settings, max_threads, repeats);
+        for (const scaling_point& p : scaling)
+            fprintf(stderr, "%-9s %2d threads: %.2f Mrays/s, speedup %.2f\n", scene_names[scaling_scene],
+                    p.threads, p.rays / p.seconds * 1e-6, scaling[0].seconds / p.seconds);
+    }
+
+    std::vector<build_result> builds;
+    if (run_build) {
+        builds = bench_build(build_primitives, settings.seed);
+        for (const build_result& b : builds)
+            fprintf(stderr, "%-5s %d primitives: built in %.3f s, %.1f MB; bvh %.3f s, %.1f MB; %.1f ns/ray; "
+                            "released in %.3f s\n", b.storage, b.primitives, b.build_seconds, b.scene_mb,
+                    b.bvh_seconds, b.bvh_mb, b.ns_per_ray, b.release_seconds);
+    }
+
+    if (!write_report(output_path, settings, scale, scaling_scene, kernels, scene_results, primary, scaling,
+                      builds)) {
+        fprintf(stderr, "Could not write %s\n", output_path);
+        return 1;
+    }
+    fprintf(stderr, "Report written to %s\n", output_path);
+}
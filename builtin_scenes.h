@@ -0,0 +1,279 @@
+#ifndef BUILTIN_SCENES_H
+#define BUILTIN_SCENES_H
+
+#include "rt.h"
+
+#include "arena.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "rectangle.h"
+#include "scene_file.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "triangle_mesh.h"
+
+#include <cstdio>
+#include <vector>
+
+#define NONE 0
+
+// The scenes below create their objects in arena, side by side in creation
+// order, and their materials in materials.
+
+hittable_list random_scene(scene_arena& arena, material_table& materials, rng& gen) {
+    hittable_list world;
+
+    auto ground_material = materials.make<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(arena.make<sphere>(point3(0,-1000,0), 1000, ground_material));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double(gen);
+            point3 center(a + 0.9*random_double(gen), 0.2, b + 0.9*random_double(gen));
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                const material* sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random(gen) * color::random(gen);
+                    sphere_material = materials.make<lambertian>(albedo);
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(gen, 0.5, 1);
+                    auto fuzz = random_double(gen, 0, 0.5);
+                    sphere_material = materials.make<metal>(albedo, fuzz);
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                } else {
+                    // glass
+                    auto albedo = color::random(gen, 0.9, 1);
+                    sphere_material = materials.make<dielectric>(1.5, albedo);
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = materials.make<dielectric>(1.5, color(1.0, 1.0, 1.0));
+    world.add(arena.make<sphere>(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = materials.make<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(arena.make<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = materials.make<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(arena.make<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+hittable_list cornell_box(scene_arena& arena, material_table& materials) {
+    hittable_list objects;
+
+    auto red   = materials.make<lambertian>(color(.65, .05, .05));
+    auto white = materials.make<lambertian>(color(.73, .73, .73));
+    auto green = materials.make<lambertian>(color(.12, .45, .15));
+    auto light_source = materials.make<light>(color(15.0, 15.0, 15.0));
+
+    auto material1 = materials.make<dielectric>(1.5, color(1.0, 1.0, 1.0));
+    objects.add(arena.make<sphere>(point3(280, 200, 280), 50.0, material1));
+
+    objects.add(arena.make<rectangle>(NONE, NONE, 0, 555, 0, 555, 1, 555, green));
+    objects.add(arena.make<rectangle>(NONE, NONE, 0, 555, 0, 555, 1, 0, red));
+    objects.add(arena.make<rectangle>(213, 343, NONE, NONE, 227, 332, 2, 554, light_source));
+    objects.add(arena.make<rectangle>(0, 555, NONE, NONE, 0, 555, 2, 0, white));
+    objects.add(arena.make<rectangle>(0, 555, NONE, NONE, 0, 555, 2, 555, white));
+    objects.add(arena.make<rectangle>(0, 555, 0, 555, NONE, NONE, 3, 555, white));
+
+    return objects;
+}
+
+hittable_list triangle_scene(scene_arena& arena, material_table& materials, rng& gen) {
+    hittable_list objects;
+
+    auto ground_material = materials.make<lambertian>(color(0.5, 0.5, 0.5));
+    objects.add(arena.make<sphere>(point3(0,-1000,0), 1000, ground_material));
+
+    for (int a = -41; a < 41; a+=5) {
+        for (int b = -41; b < 41; b+=5) {
+            auto choose_mat = random_double(gen);
+            point3 p1(a + 0.9*random_double(gen), 0.4 + 3.0*random_double(gen), b + 0.9*random_double(gen));
+            point3 p2(p1.x() + random_double(gen, 1.0, 4.0), p1.y(), p1.z() - random_double(gen, 1.0, 4.0));
+            point3 p3(p1.x() + random_double(gen, 0, 4.0), p1.y() + random_double(gen, 1.0, 4.0), p1.z() + random_double(gen, 0, 4.0));
+            const material* sphere_material;
+
+            if (choose_mat < 0.8) {
+                // diffuse
+                auto albedo = color::random(gen) * color::random(gen);
+                sphere_material = materials.make<lambertian>(albedo);
+                objects.add(arena.make<triangle>(p1, p2, p3, sphere_material));
+            } else {
+                // metal
+                auto albedo = color::random(gen, 0.5, 1);
+                auto fuzz = random_double(gen, 0, 0.5);
+                sphere_material = materials.make<metal>(albedo, fuzz);
+                objects.add(arena.make<triangle>(p1, p2, p3, sphere_material));
+            }
+        }
+    }
+
+    return objects;
+}
+
+hittable_list instance_scene(scene_arena& arena, material_table& materials, rng& gen) {
+    hittable_list objects;
+
+    auto ground_material = materials.make<lambertian>(color(0.5, 0.5, 0.5));
+    objects.add(arena.make<sphere>(point3(0,-1000,0), 1000, ground_material));
+
+    // One prop (a pyramid topped with a ball) with its own bottom-level BVH,
+    // shared by every instance below. The BVH and the instances hold
+    // pointers to arena objects, so they live outside the arena (see
+    // scene_arena).
+    auto base = materials.make<lambertian>(color(0.5, 0.5, 0.5));
+    point3 apex(0, 1.2, 0);
+    point3 corners[4] = { point3(-0.5, 0, -0.5), point3(0.5, 0, -0.5), point3(0.5, 0, 0.5), point3(-0.5, 0, 0.5) };
+    hittable_list prop;
+    for (int k = 0; k < 4; k++)
+        prop.add(arena.make<triangle>(corners[k], corners[(k+1)%4], apex, base));
+    prop.add(arena.make<sphere>(point3(0, 1.4, 0), 0.25, base));
+    auto prop_bvh = make_shared<bvh>(prop);
+
+    const material* palette[8];
+    for (int k = 0; k < 6; k++)
+        palette[k] = materials.make<lambertian>(color::random(gen) * color::random(gen));
+    palette[6] = materials.make<metal>(color(0.7, 0.6, 0.5), 0.1);
+    palette[7] = materials.make<dielectric>(1.5, color(1.0, 1.0, 1.0));
+
+    for (int a = -50; a < 50; a++) {
+        for (int b = -50; b < 50; b++) {
+            point3 position(2*a + 1.2*random_double(gen), 0, 2*b + 1.2*random_double(gen));
+            transform placement = transform::translate(position)
+                * transform::rotate(vec3(0, 1, 0), random_double(gen, 0, 360))
+                * transform::scale(random_double(gen, 0.4, 1.0));
+            auto mat = palette[static_cast<int>(8 * random_double(gen))];
+            objects.add(make_shared<instance>(prop_bvh, placement, mat));
+        }
+    }
+
+    return objects;
+}
+
+// Tessellated sphere of the given resolution, wound outward.
+shared_ptr<triangle_mesh> sphere_mesh(scene_arena& arena, point3 center, double radius, int rings, int segments,
+                                      const material* m) {
+    std::vector<point3> vertices;
+    std::vector<uint32_t> indices;
+    for (int i = 0; i <= rings; i++) {
+        double theta = pi * i / rings;
+        for (int j = 0; j < segments; j++) {
+            double phi = 2 * pi * j / segments;
+            vertices.push_back(center + radius * vec3(sin(theta)*cos(phi), cos(theta), sin(theta)*sin(phi)));
+        }
+    }
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < segments; j++) {
+            uint32_t a = i*segments + j, b = i*segments + (j+1) % segments;
+            uint32_t c = a + segments, d = b + segments;
+            uint32_t quad[6] = { a, b, c, b, d, c };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    return arena.make<triangle_mesh>(vertices, indices, m);
+}
+
+hittable_list mesh_scene(scene_arena& arena, material_table& materials, rng& gen) {
+    hittable_list objects;
+
+    // A rolling height field of 2 * 512 * 512 triangles.
+    const int n = 512;
+    const double size = 40.0;
+    std::vector<point3> vertices;
+    std::vector<uint32_t> indices;
+    for (int i = 0; i <= n; i++) {
+        for (int j = 0; j <= n; j++) {
+            double x = size * (double(i) / n - 0.5);
+            double z = size * (double(j) / n - 0.5);
+            double y = 0.6 * sin(0.7*x) * cos(0.5*z) + 0.05 * random_double(gen);
+            vertices.push_back(point3(x, y, z));
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            uint32_t a = i*(n+1) + j, b = a + 1, c = a + (n+1), d = c + 1;
+            uint32_t quad[6] = { a, b, c, b, d, c };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    auto terrain = arena.make<triangle_mesh>(vertices, indices, materials.make<lambertian>(color(0.4, 0.5, 0.3)));
+    objects.add(terrain);
+
+    auto glass = sphere_mesh(arena, point3(0, 2.5, 0), 2.0, 128, 256, materials.make<dielectric>(1.5, color(1.0, 1.0, 1.0)));
+    objects.add(glass);
+    objects.add(sphere_mesh(arena, point3(-5, 2.5, -2), 2.0, 64, 128, materials.make<metal>(color(0.7, 0.6, 0.5), 0.05)));
+
+    size_t triangles = terrain->triangle_count() + glass->triangle_count();
+    size_t bytes = terrain->memory_usage() + glass->memory_usage();
+    fprintf(stderr, "Meshes: %zu triangles, %.1f MB (%.1f bytes per triangle)\n",
+            triangles, bytes / 1048576.0, double(bytes) / triangles);
+
+    return objects;
+}
+
+const int builtin_scene_count = 5;
+
+// Fills scene with built-in scene number type (0: random scene, 1: cornell
+// box, 2: triangle scene, 3: instanced scene, 4: mesh scene) and the camera
+// it is rendered from. Random placement is drawn from gen.
+bool builtin_scene(int type, material_table& materials, rng& gen, scene_description& scene) {
+    scene.aperture = 0.1;
+    scene.image_width = 1200;
+    scene.aspect_ratio = 3.0 / 2.0;
+    scene.black_background = false;
+    switch (type) {
+        case 0:
+            scene.lookfrom = point3(13, 2, 3);
+            scene.lookat = point3(0,0,0);
+            scene.focus_dist = 10.0;
+            scene.vfov = 20.0;
+            scene.world = random_scene(*scene.arena, materials, gen);
+            return true;
+        case 1:
+            scene.aspect_ratio = 1.0;
+            scene.image_width = 600;
+            scene.lookfrom = point3(278, 278, -800);
+            scene.lookat = point3(278, 278, 0);
+            scene.focus_dist = 10.0;
+            scene.vfov = 40.0;
+            scene.world = cornell_box(*scene.arena, materials);
+            // Lit only by its light.
+            scene.black_background = true;
+            return true;
+        case 2:
+            scene.lookfrom = point3(39, 6, 9);
+            scene.lookat = point3(0,0,0);
+            scene.focus_dist = 30.0;
+            scene.vfov = 20.0;
+            scene.world = triangle_scene(*scene.arena, materials, gen);
+            return true;
+        case 3:
+            scene.lookfrom = point3(30, 8, 30);
+            scene.lookat = point3(0,0,0);
+            scene.focus_dist = 40.0;
+            scene.vfov = 30.0;
+            scene.world = instance_scene(*scene.arena, materials, gen);
+            return true;
+        case 4:
+            scene.lookfrom = point3(4, 6, 16);
+            scene.lookat = point3(-1,1.5,0);
+            scene.focus_dist = 16.0;
+            scene.vfov = 35.0;
+            scene.world = mesh_scene(*scene.arena, materials, gen);
+            return true;
+    }
+    return false;
+}
+
+#endif
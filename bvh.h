@@ -0,0 +1,623 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "rt.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "primitive_block.h"
+#include "ray_packet.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+// Node of a flattened bounding volume hierarchy. Nodes are stored in
+// depth-first order, so the first child of an interior node is always the
+// next node in the array and only the second child needs an explicit index.
+struct bvh_node {
+    aabb box;
+    int offset;     // leaf: first primitive; interior: index of the second child
+    short count;    // number of primitives in a leaf, 0 for interior nodes
+    short axis;     // split axis of an interior node
+};
+
+// Most nodes on any path from the root of a hierarchy bvh_builder builds, and
+// so the size of the traversal stacks, which hold at most one node per level.
+const int bvh_max_depth = 64;
+
+// Builds a hierarchy over primitives given only by their bounds, using the
+// surface area heuristic evaluated over binned centroids on all three axes.
+// On return, order[k] is the primitive referenced by leaf slot k.
+// block_size is the number of primitives a leaf kernel tests at once; the
+// SAH charges leaves per block rather than per primitive.
+class bvh_builder {
+    public:
+        bvh_builder(int max_leaf_size = 4, int block_size = 1)
+            : max_leaf_size(max_leaf_size), block_size(block_size) {}
+
+        std::vector<bvh_node> build(const std::vector<aabb>& boxes, std::vector<int>& order);
+
+        // Cost of a traversal step relative to intersecting one primitive.
+        static constexpr double traversal_cost = 0.125;
+
+    private:
+        struct build_prim {
+            aabb box;
+            point3 centroid;
+            int index;
+        };
+
+        struct bin {
+            aabb box;
+            int count = 0;
+        };
+
+        int build_recursive(int begin, int end, int depth);
+
+        int blocks(int n) const { return (n + block_size - 1) / block_size; }
+
+        static const int bin_count = 12;
+
+        // Depth below which splits are chosen by the SAH. Deeper down they
+        // halve the primitives, which takes at most 31 more levels, so the
+        // tree stays within bvh_max_depth however lopsided the SAH would
+        // make it (e.g. for primitives spaced exponentially along an axis).
+        static const int sah_depth_limit = bvh_max_depth - 32;
+
+        int max_leaf_size;
+        int block_size;
+        std::vector<build_prim> prims;
+        std::vector<bvh_node> nodes;
+};
+
+std::vector<bvh_node> bvh_builder::build(const std::vector<aabb>& boxes, std::vector<int>& order) {
+    prims.clear();
+    nodes.clear();
+    for (size_t i = 0; i < boxes.size(); i++) {
+        build_prim p;
+        p.box = boxes[i];
+        p.centroid = boxes[i].centroid();
+        p.index = static_cast<int>(i);
+        prims.push_back(p);
+    }
+
+    if (!prims.empty()) {
+        nodes.reserve(2 * prims.size());
+        build_recursive(0, static_cast<int>(prims.size()), 0);
+    }
+
+    order.resize(prims.size());
+    for (size_t k = 0; k < prims.size(); k++)
+        order[k] = prims[k].index;
+
+    // Copy out rather than swap, so the result does not keep the reserve.
+    std::vector<bvh_node> result(nodes.begin(), nodes.end());
+    nodes.clear();
+    return result;
+}
+
+int bvh_builder::build_recursive(int begin, int end, int depth) {
+    int node_index = static_cast<int>(nodes.size());
+    nodes.push_back(bvh_node());
+
+    aabb bounds, centroid_bounds;
+    for (int i = begin; i < end; i++) {
+        bounds.expand(prims[i].box);
+        centroid_bounds.expand(prims[i].centroid);
+    }
+    nodes[node_index].box = bounds;
+
+    int n = end - begin;
+    auto make_leaf = [&]() {
+        nodes[node_index].offset = begin;
+        nodes[node_index].count = static_cast<short>(n);
+        nodes[node_index].axis = 0;
+        return node_index;
+    };
+
+    auto make_interior = [&](int mid, int axis) {
+        build_recursive(begin, mid, depth + 1);
+        int second = build_recursive(mid, end, depth + 1);
+        nodes[node_index].offset = second;
+        nodes[node_index].count = 0;
+        nodes[node_index].axis = static_cast<short>(axis);
+        return node_index;
+    };
+
+    if (n == 1 || (depth >= sah_depth_limit && n <= max_leaf_size))
+        return make_leaf();
+    if (depth >= sah_depth_limit) {
+        int axis = centroid_bounds.longest_axis();
+        int mid = begin + n / 2;
+        std::nth_element(&prims[begin], &prims[mid], &prims[0] + end, [axis](const build_prim& a, const build_prim& b) {
+            return a.centroid[axis] < b.centroid[axis];
+        });
+        return make_interior(mid, axis);
+    }
+
+    // Find the cheapest binned split over all three axes. Costs are relative
+    // to intersecting one primitive, with a traversal step costing 1/8 of that.
+    double best_cost = infinity;
+    int best_axis = -1;
+    int best_split = 0;
+    double parent_area = bounds.surface_area();
+
+    for (int axis = 0; axis < 3; axis++) {
+        double lo = centroid_bounds.minimum[axis];
+        double extent = centroid_bounds.maximum[axis] - lo;
+        if (extent <= 0)
+            continue;
+
+        bin bins[bin_count];
+        for (int i = begin; i < end; i++) {
+            int b = static_cast<int>(bin_count * (prims[i].centroid[axis] - lo) / extent);
+            b = std::min(b, bin_count - 1);
+            bins[b].count++;
+            bins[b].box.expand(prims[i].box);
+        }
+
+        // Sweep from the right to get the cost of every right-hand side, then
+        // from the left to combine it with the matching left-hand side.
+        double right_area[bin_count];
+        int right_count[bin_count];
+        aabb acc;
+        int count = 0;
+        for (int b = bin_count - 1; b > 0; b--) {
+            acc.expand(bins[b].box);
+            count += bins[b].count;
+            right_area[b] = acc.surface_area();
+            right_count[b] = count;
+        }
+
+        acc = aabb();
+        count = 0;
+        for (int b = 0; b < bin_count - 1; b++) {
+            acc.expand(bins[b].box);
+            count += bins[b].count;
+            if (count == 0 || right_count[b+1] == 0)
+                continue;
+            double cost = traversal_cost
+                + (acc.surface_area() * blocks(count) + right_area[b+1] * blocks(right_count[b+1])) / parent_area;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    int mid;
+    if (best_axis < 0) {
+        // All centroids coincide, so no split separates them; cut by count.
+        if (n <= max_leaf_size)
+            return make_leaf();
+        mid = begin + n / 2;
+        best_axis = 0;
+    } else {
+        if (n <= max_leaf_size && blocks(n) <= best_cost)
+            return make_leaf();
+
+        double lo = centroid_bounds.minimum[best_axis];
+        double extent = centroid_bounds.maximum[best_axis] - lo;
+        build_prim* split = std::partition(&prims[begin], &prims[0] + end, [&](const build_prim& p) {
+            int b = static_cast<int>(bin_count * (p.centroid[best_axis] - lo) / extent);
+            return std::min(b, bin_count - 1) <= best_split;
+        });
+        mid = static_cast<int>(split - &prims[0]);
+    }
+
+    return make_interior(mid, best_axis);
+}
+
+// Expected cost of tracing a ray that meets the root box through the
+// hierarchy, by the surface area heuristic in the builder's units: each node
+// costs a traversal step, each leaf its primitives, weighted by the chance
+// that the ray meets their box. It grows as refitting stretches the boxes of
+// a tree built for other positions of its primitives.
+double bvh_sah_cost(const std::vector<bvh_node>& nodes) {
+    if (nodes.empty() || nodes[0].box.surface_area() <= 0)
+        return 0;
+    double cost = 0;
+    for (const bvh_node& node : nodes)
+        cost += node.box.surface_area() * (node.count > 0 ? node.count : bvh_builder::traversal_cost);
+    return cost / nodes[0].box.surface_area();
+}
+
+// Closest-hit traversal of a flattened hierarchy. Children are visited near
+// first, according to the sign of the ray direction on the node's split axis,
+// so that far subtrees are usually culled by the shrinking t_max.
+// leaf(first, count, t_max) tests the primitives of a leaf and returns true
+// if it found a hit, lowering t_max to it. root selects the subtree to
+// traverse.
+template <typename LeafFn>
+bool bvh_traverse(const std::vector<bvh_node>& nodes, const ray& r,
+                  real t_min, real t_max, LeafFn leaf, int root = 0) {
+    if (nodes.empty())
+        return false;
+
+    const point3 origin = r.origin();
+    const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    const bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+    int stack[bvh_max_depth];
+    int stack_size = 0;
+    int current = root;
+    bool hit_anything = false;
+
+    while (true) {
+        const bvh_node& node = nodes[current];
+        STAT(++thread_stats.node_visits);
+        if (node.box.hit(origin, inv_dir, t_min, t_max)) {
+            if (node.count > 0) {
+                if (leaf(node.offset, node.count, t_max))
+                    hit_anything = true;
+            } else if (dir_is_neg[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
+
+// Closest-hit traversal of the rays of a prepared packet in the mask active.
+// Each node is tested first against the bounds of the whole packet, then
+// against its rays four at a time, and only the rays that meet its box go on
+// to the children. Rays visit nodes in the order bvh_traverse() would give
+// them, so they find the same hits. A packet whose rays point different
+// ways, and a ray left alone in a subtree, fall back to bvh_traverse().
+// leaf(rays, first, count) tests the rays in the mask rays against the
+// primitives of a leaf, lowers their packet.t_max to any hit and returns the
+// mask of those that hit. Returns the mask of rays in active that hit.
+template <typename LeafFn>
+int bvh_traverse_packet(const std::vector<bvh_node>& nodes, ray_packet& packet, real t_min,
+                        int active, LeafFn leaf) {
+    if (nodes.empty() || !active)
+        return 0;
+
+    int hits = 0;
+    auto trace_single = [&](int k, int root) {
+        auto single_leaf = [&](int first, int count, real& closest) {
+            if (!leaf(1 << k, first, count))
+                return false;
+            closest = packet.t_max[k];
+            return true;
+        };
+        if (bvh_traverse(nodes, packet.rays[k], t_min, packet.t_max[k], single_leaf, root))
+            hits |= 1 << k;
+    };
+
+    if (!packet.coherent) {
+        for (int k = 0; k < packet.count; k++)
+            if ((active >> k) & 1)
+                trace_single(k, 0);
+        return hits;
+    }
+
+    struct entry {
+        int node;
+        int active;     // rays that met the parent's box
+    };
+    entry stack[bvh_max_depth];
+    int stack_size = 0;
+    int current = 0;
+    const int rays = active;
+    real t_far = packet.farthest(rays);
+
+    while (true) {
+        const bvh_node& node = nodes[current];
+        STAT(++thread_stats.node_visits);
+        active = packet.frustum_hits(node.box, t_min, t_far) ? packet.hit_box(node.box, t_min, active) : 0;
+        if (active && node.count > 0) {
+            hits |= leaf(active, node.offset, node.count);
+            t_far = packet.farthest(rays);
+        } else if (active && !(active & (active - 1))) {
+            // A single ray is cheaper to trace on its own.
+            int k = 0;
+            while (!((active >> k) & 1))
+                k++;
+            bool far_first = packet.dir_is_neg[node.axis];
+            trace_single(k, far_first ? node.offset : current + 1);
+            trace_single(k, far_first ? current + 1 : node.offset);
+        } else if (active) {
+            if (packet.dir_is_neg[node.axis]) {
+                stack[stack_size].node = current + 1;
+                current = node.offset;
+            } else {
+                stack[stack_size].node = node.offset;
+                current = current + 1;
+            }
+            stack[stack_size++].active = active;
+            continue;
+        }
+        if (stack_size == 0)
+            break;
+        --stack_size;
+        current = stack[stack_size].node;
+        active = stack[stack_size].active;
+    }
+
+    return hits;
+}
+
+// Any-hit traversal of a flattened hierarchy: returns true as soon as
+// leaf(first, count) reports that a primitive of a leaf meets r between t_min
+// and t_max. Nodes are visited in the same order as by bvh_traverse(), but
+// nothing shrinks the interval, so a visible query walks every node it meets.
+template <typename LeafFn>
+bool bvh_occluded(const std::vector<bvh_node>& nodes, const ray& r,
+                  real t_min, real t_max, LeafFn leaf, int root = 0) {
+    if (nodes.empty())
+        return false;
+
+    const point3 origin = r.origin();
+    const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    const bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+    int stack[bvh_max_depth];
+    int stack_size = 0;
+    int current = root;
+
+    while (true) {
+        const bvh_node& node = nodes[current];
+        STAT(++thread_stats.node_visits);
+        if (node.box.hit(origin, inv_dir, t_min, t_max)) {
+            if (node.count > 0) {
+                if (leaf(node.offset, node.count))
+                    return true;
+            } else if (dir_is_neg[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return false;
+}
+
+// Any-hit traversal of the rays of a prepared packet in the mask active, each
+// between t_min and its packet.t_max, culled as in bvh_traverse_packet().
+// A ray leaves the packet once it is found to be blocked, and traversal ends
+// when none is left. leaf(rays, first, count) returns the mask of the rays in
+// rays that meet a primitive of the leaf. Returns the mask of blocked rays.
+template <typename LeafFn>
+int bvh_occluded_packet(const std::vector<bvh_node>& nodes, const ray_packet& packet, real t_min,
+                        int active, LeafFn leaf) {
+    if (nodes.empty() || !active)
+        return 0;
+
+    int blocked = 0;
+    auto trace_single = [&](int k, int root) {
+        auto single_leaf = [&](int first, int count) {
+            return leaf(1 << k, first, count) != 0;
+        };
+        if (!((blocked >> k) & 1) && bvh_occluded(nodes, packet.rays[k], t_min, packet.t_max[k], single_leaf, root))
+            blocked |= 1 << k;
+    };
+
+    if (!packet.coherent) {
+        for (int k = 0; k < packet.count; k++)
+            if ((active >> k) & 1)
+                trace_single(k, 0);
+        return blocked;
+    }
+
+    struct entry {
+        int node;
+        int active;     // rays that met the parent's box
+    };
+    entry stack[bvh_max_depth];
+    int stack_size = 0;
+    int current = 0;
+    const real t_far = packet.farthest(active);
+
+    while (true) {
+        const bvh_node& node = nodes[current];
+        STAT(++thread_stats.node_visits);
+        active = packet.frustum_hits(node.box, t_min, t_far) ? packet.hit_box(node.box, t_min, active) : 0;
+        if (active && node.count > 0) {
+            blocked |= leaf(active, node.offset, node.count);
+        } else if (active && !(active & (active - 1))) {
+            // A single ray is cheaper to trace on its own.
+            int k = 0;
+            while (!((active >> k) & 1))
+                k++;
+            trace_single(k, current + 1);
+            trace_single(k, node.offset);
+        } else if (active) {
+            if (packet.dir_is_neg[node.axis]) {
+                stack[stack_size].node = current + 1;
+                current = node.offset;
+            } else {
+                stack[stack_size].node = node.offset;
+                current = current + 1;
+            }
+            stack[stack_size++].active = active;
+            continue;
+        }
+
+        // Skip subtrees whose rays have all been blocked meanwhile.
+        do {
+            if (stack_size == 0)
+                return blocked;
+            --stack_size;
+            current = stack[stack_size].node;
+            active = stack[stack_size].active & ~blocked;
+        } while (!active);
+    }
+}
+
+class bvh : public hittable {
+    public:
+        bvh() {}
+        bvh(const hittable_list& list, bool pack = simd_leaves);
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual int occluded_packet(const ray_packet& packet, real t_min, int active) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
+
+        // Recomputes the boxes of the nodes from the objects' bounds as they
+        // are now, keeping the tree, e.g. after instances have moved. Cheaper
+        // than building it again, but the tree may fit the new positions
+        // worse; see bvh_sah_cost().
+        void refit();
+
+    private:
+        void pack_leaves();
+
+    public:
+        std::vector<bvh_node> nodes;
+        std::vector<shared_ptr<hittable>> objects; // in leaf order
+};
+
+bvh::bvh(const hittable_list& list, bool pack) {
+    std::vector<aabb> boxes(list.objects.size());
+    for (size_t i = 0; i < list.objects.size(); i++) {
+        if (!list.objects[i]->bounding_box(boxes[i]))
+            fprintf(stderr, "No bounding box in bvh constructor.\n");
+    }
+
+    std::vector<int> order;
+    nodes = bvh_builder(4, pack ? 4 : 1).build(boxes, order);
+    for (int index : order)
+        objects.push_back(list.objects[index]);
+
+    if (pack)
+        pack_leaves();
+}
+
+// Replaces the triangles and spheres of each leaf by triangle4/sphere4 blocks,
+// leaving any other kind of object as it is.
+void bvh::pack_leaves() {
+    std::vector<shared_ptr<hittable>> packed;
+
+    for (auto& node : nodes) {
+        if (node.count == 0)
+            continue;
+
+        auto triangles = make_shared<triangle4>();
+        auto spheres = make_shared<sphere4>();
+        shared_ptr<hittable> single_triangle, single_sphere;
+        std::vector<shared_ptr<hittable>> others;
+        for (int k = node.offset; k < node.offset + node.count; k++) {
+            if (auto tri = std::dynamic_pointer_cast<triangle>(objects[k])) {
+                triangles->add(*tri);
+                single_triangle = tri;
+            } else if (auto sph = std::dynamic_pointer_cast<sphere>(objects[k])) {
+                spheres->add(*sph);
+                single_sphere = sph;
+            } else {
+                others.push_back(objects[k]);
+            }
+        }
+
+        // A block only pays off once it holds more than one primitive.
+        int first = static_cast<int>(packed.size());
+        if (triangles->count > 1)
+            packed.push_back(triangles);
+        else if (triangles->count == 1)
+            packed.push_back(single_triangle);
+        if (spheres->count > 1)
+            packed.push_back(spheres);
+        else if (spheres->count == 1)
+            packed.push_back(single_sphere);
+        packed.insert(packed.end(), others.begin(), others.end());
+
+        node.offset = first;
+        node.count = static_cast<short>(packed.size() - first);
+    }
+
+    objects.swap(packed);
+}
+
+bool bvh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    return bvh_traverse(nodes, r, t_min, t_max, [&](int first, int count, real& closest) {
+        bool hit_leaf = false;
+        for (int k = first; k < first + count; k++) {
+            if (objects[k]->hit(r, t_min, closest, rec)) {
+                hit_leaf = true;
+                closest = rec.t;
+            }
+        }
+        return hit_leaf;
+    });
+}
+
+int bvh::hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const {
+    return bvh_traverse_packet(nodes, packet, t_min, active, [&](int rays, int first, int count) {
+        int hits = 0;
+        for (int k = first; k < first + count; k++)
+            hits |= objects[k]->hit_packet(packet, t_min, recs, rays);
+        return hits;
+    });
+}
+
+bool bvh::occluded(const ray& r, real t_min, real t_max) const {
+    return bvh_occluded(nodes, r, t_min, t_max, [&](int first, int count) {
+        for (int k = first; k < first + count; k++)
+            if (objects[k]->occluded(r, t_min, t_max))
+                return true;
+        return false;
+    });
+}
+
+int bvh::occluded_packet(const ray_packet& packet, real t_min, int active) const {
+    return bvh_occluded_packet(nodes, packet, t_min, active, [&](int rays, int first, int count) {
+        int blocked = 0;
+        for (int k = first; k < first + count && (rays & ~blocked); k++)
+            blocked |= objects[k]->occluded_packet(packet, t_min, rays & ~blocked);
+        return blocked;
+    });
+}
+
+// Children come after their parent in depth-first order, so a pass from the
+// back sees both children of a node before the node.
+void bvh::refit() {
+    for (size_t n = nodes.size(); n-- > 0; ) {
+        bvh_node& node = nodes[n];
+        aabb box;
+        if (node.count > 0) {
+            for (int k = node.offset; k < node.offset + node.count; k++) {
+                aabb object_box;
+                if (objects[k]->bounding_box(object_box))
+                    box.expand(object_box);
+            }
+        } else {
+            box = nodes[n + 1].box;
+            box.expand(nodes[node.offset].box);
+        }
+        node.box = box;
+    }
+}
+
+bool bvh::bounding_box(aabb& output_box) const {
+    if (nodes.empty())
+        return false;
+    output_box = nodes[0].box;
+    return true;
+}
+
+#endif
@@ -9,10 +9,10 @@ class camera {
             point3 lookfrom,
             point3 lookat,
             vec3   vup,
-            double vfov, // vertical field-of-view in degrees
-            double aspect_ratio,
-            double aperture,
-            double focus_dist
+            real vfov, // vertical field-of-view in degrees
+            real aspect_ratio,
+            real aperture,
+            real focus_dist
         ) {
             auto theta = degrees_to_radians(vfov);
             auto h = tan(theta/2);
@@ -33,8 +33,8 @@ class camera {
         camera() {}
 
 
-        ray get_ray(double s, double t) const {
-            vec3 rd = lens_radius * random_in_unit_disk();
+        ray get_ray(real s, real t, rng& gen) const {
+            vec3 rd = lens_radius * random_in_unit_disk(gen);
             vec3 offset = u * rd.x() + v * rd.y();
 
             return ray(
@@ -49,6 +49,6 @@ class camera {
         vec3 horizontal;
         vec3 vertical;
         vec3 u, v, w;
-        double lens_radius;
+        real lens_radius;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,74 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "rt.h"
+
+#include "render.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+// State of a progressive render after a whole number of passes. Every pixel
+// has taken the same number of samples, and sample s of a pixel is seeded from
+// (seed, pixel, s), so the seed and the sample count are the complete rng
+// state: resuming continues exactly where the render stopped.
+struct checkpoint_info {
+    uint64_t seed;
+    int32_t width;
+    int32_t height;
+    int32_t scene;          // world_type the sums belong to, or a hash of the scene file with the high bit set
+    int32_t method;         // integrator, plus 0x100 with light sampling and 0x200 with sobol samples
+    int32_t max_depth;
+    int32_t samples;        // completed samples per pixel
+};
+
+// File layout: the 8-byte magic, checkpoint_info, then width*height colors of
+// unnormalized sums as three native doubles each.
+static const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '1'};
+
+// Writes a checkpoint next to path and renames it into place once it is on
+// disk, so a crash while writing leaves the previous checkpoint intact.
+bool save_checkpoint(const char* path, const checkpoint_info& info, const framebuffer& fb) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (!out)
+        return false;
+
+    bool ok = fwrite(checkpoint_magic, sizeof(checkpoint_magic), 1, out) == 1
+           && fwrite(&info, sizeof(info), 1, out) == 1
+           && fwrite(fb.pixels.data(), sizeof(color), fb.pixels.size(), out) == fb.pixels.size()
+           && fflush(out) == 0
+           && fsync(fileno(out)) == 0;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Reads a checkpoint written by save_checkpoint() into info and fb, which is
+// resized to the stored dimensions.
+bool load_checkpoint(const char* path, checkpoint_info& info, framebuffer& fb) {
+    FILE* in = fopen(path, "rb");
+    if (!in)
+        return false;
+
+    char magic[sizeof(checkpoint_magic)];
+    bool ok = fread(magic, sizeof(magic), 1, in) == 1
+           && memcmp(magic, checkpoint_magic, sizeof(magic)) == 0
+           && fread(&info, sizeof(info), 1, in) == 1
+           && info.width > 0 && info.height > 0 && info.samples >= 0;
+    if (ok) {
+        fb = framebuffer(info.width, info.height);
+        ok = fread(fb.pixels.data(), sizeof(color), fb.pixels.size(), in) == fb.pixels.size()
+          && fgetc(in) == EOF;
+    }
+    fclose(in);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef CLOSED_SCENE_H
+#define CLOSED_SCENE_H
+
+#include "rt.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "rectangle.h"
+#include "sphere.h"
+#include "triangle.h"
+
+#include <cstdint>
+#include <vector>
+
+// Scene representation for a closed set of primitive kinds. Spheres,
+// triangles and rectangles are copied by value into one array per type and
+// referenced from the leaves of a bvh by (kind, index), so the leaf loop calls
+// each primitive's hit() non-virtually and the compiler can inline it. Any
+// other object is kept as a hittable and still called through the vtable.
+// Being final, calls made on a closed_scene itself are devirtualized too.
+class closed_scene final : public hittable {
+    public:
+        static const bool closed_set = true;
+
+        closed_scene() {}
+        closed_scene(const hittable_list& list);
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual int occluded_packet(const ray_packet& packet, real t_min, int active) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
+
+    private:
+        bool hit_ref(uint32_t ref, const ray& r, real t_min, real t_max, hit_record& rec) const;
+        bool occluded_ref(uint32_t ref, const ray& r, real t_min, real t_max) const;
+
+        enum { sphere_ref = 0, triangle_ref = 1, rectangle_ref = 2, other_ref = 3 };
+
+        static uint32_t make_ref(uint32_t kind, size_t index) {
+            return (kind << 30) | static_cast<uint32_t>(index);
+        }
+
+    public:
+        std::vector<sphere> spheres;
+        std::vector<triangle> triangles;
+        std::vector<rectangle> rectangles;
+        std::vector<shared_ptr<hittable>> others;
+        std::vector<bvh_node> nodes;
+        std::vector<uint32_t> refs; // kind in the top two bits, array index below
+};
+
+closed_scene::closed_scene(const hittable_list& list) {
+    std::vector<uint32_t> unordered;
+    std::vector<aabb> boxes;
+
+    for (const auto& object : list.objects) {
+        aabb box;
+        if (!object->bounding_box(box))
+            fprintf(stderr, "No bounding box in closed_scene constructor.\n");
+        boxes.push_back(box);
+
+        if (auto s = dynamic_cast<const sphere*>(object.get())) {
+            unordered.push_back(make_ref(sphere_ref, spheres.size()));
+            spheres.push_back(*s);
+        } else if (auto t = dynamic_cast<const triangle*>(object.get())) {
+            unordered.push_back(make_ref(triangle_ref, triangles.size()));
+            triangles.push_back(*t);
+        } else if (auto q = dynamic_cast<const rectangle*>(object.get())) {
+            unordered.push_back(make_ref(rectangle_ref, rectangles.size()));
+            rectangles.push_back(*q);
+        } else {
+            unordered.push_back(make_ref(other_ref, others.size()));
+            others.push_back(object);
+        }
+    }
+
+    std::vector<int> order;
+    nodes = bvh_builder(4).build(boxes, order);
+    for (int index : order)
+        refs.push_back(unordered[index]);
+}
+
+bool closed_scene::hit_ref(uint32_t ref, const ray& r, real t_min, real t_max, hit_record& rec) const {
+    uint32_t index = ref & 0x3fffffff;
+    switch (ref >> 30) {
+        case sphere_ref:
+            return spheres[index].sphere::hit(r, t_min, t_max, rec);
+        case triangle_ref:
+            return triangles[index].triangle::hit(r, t_min, t_max, rec);
+        case rectangle_ref:
+            return rectangles[index].rectangle::hit(r, t_min, t_max, rec);
+        default:
+            return others[index]->hit(r, t_min, t_max, rec);
+    }
+}
+
+bool closed_scene::occluded_ref(uint32_t ref, const ray& r, real t_min, real t_max) const {
+    uint32_t index = ref & 0x3fffffff;
+    switch (ref >> 30) {
+        case sphere_ref:
+            return spheres[index].sphere::occluded(r, t_min, t_max);
+        case triangle_ref:
+            return triangles[index].triangle::occluded(r, t_min, t_max);
+        case rectangle_ref:
+            return rectangles[index].rectangle::occluded(r, t_min, t_max);
+        default:
+            return others[index]->occluded(r, t_min, t_max);
+    }
+}
+
+bool closed_scene::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    return bvh_traverse(nodes, r, t_min, t_max, [&](int first, int count, real& closest) {
+        bool hit_leaf = false;
+        for (int k = first; k < first + count; k++) {
+            if (hit_ref(refs[k], r, t_min, closest, rec)) {
+                hit_leaf = true;
+                closest = rec.t;
+            }
+        }
+        return hit_leaf;
+    });
+}
+
+int closed_scene::hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const {
+    return bvh_traverse_packet(nodes, packet, t_min, active, [&](int rays, int first, int count) {
+        int hits = 0;
+        for (int k = first; k < first + count; k++) {
+            // Other objects may trace the rays together themselves.
+            if (refs[k] >> 30 == other_ref) {
+                hits |= others[refs[k] & 0x3fffffff]->hit_packet(packet, t_min, recs, rays);
+                continue;
+            }
+            for (int i = 0; i < packet.count; i++) {
+                if (((rays >> i) & 1) && hit_ref(refs[k], packet.rays[i], t_min, packet.t_max[i], recs[i])) {
+                    hits |= 1 << i;
+                    packet.t_max[i] = recs[i].t;
+                }
+            }
+        }
+        return hits;
+    });
+}
+
+bool closed_scene::occluded(const ray& r, real t_min, real t_max) const {
+    return bvh_occluded(nodes, r, t_min, t_max, [&](int first, int count) {
+        for (int k = first; k < first + count; k++)
+            if (occluded_ref(refs[k], r, t_min, t_max))
+                return true;
+        return false;
+    });
+}
+
+int closed_scene::occluded_packet(const ray_packet& packet, real t_min, int active) const {
+    return bvh_occluded_packet(nodes, packet, t_min, active, [&](int rays, int first, int count) {
+        int blocked = 0;
+        for (int k = first; k < first + count && (rays & ~blocked); k++) {
+            int open = rays & ~blocked;
+            if (refs[k] >> 30 == other_ref) {
+                blocked |= others[refs[k] & 0x3fffffff]->occluded_packet(packet, t_min, open);
+                continue;
+            }
+            for (int i = 0; i < packet.count; i++)
+                if (((open >> i) & 1) && occluded_ref(refs[k], packet.rays[i], t_min, packet.t_max[i]))
+                    blocked |= 1 << i;
+        }
+        return blocked;
+    });
+}
+
+bool closed_scene::bounding_box(aabb& output_box) const {
+    if (nodes.empty())
+        return false;
+    output_box = nodes[0].box;
+    return true;
+}
+
+#endif
@@ -5,7 +5,8 @@
 
 #include <stdio.h>
 
-void write_color(color pixel_color, int samples_per_pixel) {
+// Converts a sum of samples_per_pixel samples to 8-bit display values.
+inline void tone_map(color pixel_color, int samples_per_pixel, int rgb[3]) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -15,10 +16,16 @@ void write_color(color pixel_color, int samples_per_pixel) {
     r = sqrt(scale * r);
     g = sqrt(scale * g);
     b = sqrt(scale * b);
-    // Write the translated [0,255] value of each color component.
-    printf("%d %d %d\n", static_cast<int>(256 * clamp(r, 0.0, 0.999)),
-                        static_cast<int>(256 * clamp(g, 0.0, 0.999)),
-                        static_cast<int>(256 * clamp(b, 0.0, 0.999)));
+    // Translate to [0,255].
+    rgb[0] = static_cast<int>(256 * clamp(r, 0.0, 0.999));
+    rgb[1] = static_cast<int>(256 * clamp(g, 0.0, 0.999));
+    rgb[2] = static_cast<int>(256 * clamp(b, 0.0, 0.999));
+}
+
+void write_color(color pixel_color, int samples_per_pixel) {
+    int rgb[3];
+    tone_map(pixel_color, samples_per_pixel, rgb);
+    printf("%d %d %d\n", rgb[0], rgb[1], rgb[2]);
 }
 
 #endif
\ No newline at end of file
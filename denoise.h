@@ -0,0 +1,185 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "rt.h"
+
+#include "aov.h"
+#include "render.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Parameters of denoise(); see there.
+struct denoise_settings {
+    int iterations = 5;             // filter widths 5, 9, 17, 33, 65 pixels
+    double sigma_luminance = 4;     // in standard deviations of the noise
+    double normal_exponent = 128;
+    double sigma_depth = 1;         // in units of the local depth gradient
+    int threads = 0;                // 0: one per core
+};
+
+// Calls row(j) for every j in [0, height) on a pool of threads.
+template <typename RowFn>
+void parallel_rows(int height, int threads, RowFn row) {
+    if (threads < 1)
+        threads = default_thread_count();
+    threads = std::max(1, std::min(threads, height));
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int j; (j = next++) < height; )
+            row(j);
+    };
+    std::vector<std::thread> pool;
+    for (int k = 1; k < threads; ++k)
+        pool.push_back(std::thread(worker));
+    worker();
+    for (auto& th : pool)
+        th.join();
+}
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), with the
+// luminance weights of SVGF (Schied et al. 2017). The image is divided by
+// the albedo buffer, so that texture and material edges are kept, and the
+// remaining illumination is blurred with a 5x5 B3-spline kernel whose taps
+// are spread 1, 2, 4, ... pixels apart over the iterations. A tap's weight
+// falls off where the normal or the depth differs from the center pixel's,
+// or where its luminance differs by more than the noise explains; the noise
+// is estimated from the luminance variance of the neighbourhood and carried
+// through the iterations. The filtered illumination is multiplied by the
+// albedo again. Pixels that see a light, and their neighbours, which the
+// image's samples may see it from although the auxiliary buffers' do not,
+// are left as they are and lend no weight to the others: a lamp set into a
+// ceiling shares its normal and depth, and blurring the two would spread its
+// light over the ceiling.
+//
+// image holds sums of samples(i, j) samples per pixel, as for image_writer,
+// and is overwritten with the filtered sums.
+void denoise(framebuffer& image, std::function<int(int, int)> samples, const aov_buffers& aov,
+             const denoise_settings& settings = denoise_settings()) {
+    const int width = image.width, height = image.height;
+    const size_t n = static_cast<size_t>(width) * height;
+    const double aov_scale = 1.0 / std::max(1, aov.samples);
+    auto luminance = [](const color& c) { return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z(); };
+
+    // Per-pixel guides: what the pixel sees, demodulation factor, unit
+    // normal, depth and its screen-space gradient.
+    enum { surface, sky, emitter };
+    std::vector<char> kind(n);
+    std::vector<color> factor(n), illumination(n);
+    std::vector<vec3> normal(n);
+    std::vector<double> depth(n), grad_x(n), grad_y(n);
+    parallel_rows(height, settings.threads, [&](int j) {
+        for (int i = 0; i < width; ++i) {
+            size_t p = static_cast<size_t>(j) * width + i;
+            color a = aov.albedo.at(i, j) * aov_scale;
+            color mean = image.at(i, j) / std::max(1, samples(i, j));
+            // Channels with next to no albedo are filtered as they are.
+            for (int c = 0; c < 3; ++c) {
+                factor[p][c] = a[c] > 0.001 ? a[c] : 1;
+                illumination[p][c] = mean[c] / factor[p][c];
+            }
+            vec3 nrm = aov.normal.at(i, j);
+            normal[p] = nrm.length_squared() > 0 ? unit_vector(nrm) : nrm;
+            kind[p] = normal[p].length_squared() == 0 ? sky : surface;
+            for (int y = std::max(j-1, 0); y <= std::min(j+1, height-1); ++y)
+                for (int x = std::max(i-1, 0); x <= std::min(i+1, width-1); ++x)
+                    if (luminance(aov.emission.at(x, y)) > 0)
+                        kind[p] = emitter;
+            depth[p] = aov.depth.at(i, j).x() * aov_scale;
+        }
+    });
+    auto depth_at = [&](int i, int j) {
+        return depth[static_cast<size_t>(std::min(std::max(j, 0), height-1)) * width
+                     + std::min(std::max(i, 0), width-1)];
+    };
+    parallel_rows(height, settings.threads, [&](int j) {
+        for (int i = 0; i < width; ++i) {
+            size_t p = static_cast<size_t>(j) * width + i;
+            grad_x[p] = 0.5 * (depth_at(i+1, j) - depth_at(i-1, j));
+            grad_y[p] = 0.5 * (depth_at(i, j+1) - depth_at(i, j-1));
+        }
+    });
+
+    auto geometry_weight = [&](size_t p, size_t q, int dx, int dy) {
+        if (kind[p] != kind[q])
+            return 0.0;
+        if (kind[p] != surface)
+            return 1.0;
+        double w = pow(fmax(0.0, dot(normal[p], normal[q])), settings.normal_exponent);
+        double expected = fabs(grad_x[p] * dx + grad_y[p] * dy);
+        return w * exp(-fabs(depth[p] - depth[q]) / (settings.sigma_depth * expected + 1e-3 * depth[p] + 1e-9));
+    };
+
+    // Initial noise estimate: luminance variance over the 5x5 neighbourhood,
+    // restricted to pixels on the same surface.
+    std::vector<double> variance(n), next_variance(n);
+    std::vector<color> next(n);
+    parallel_rows(height, settings.threads, [&](int j) {
+        for (int i = 0; i < width; ++i) {
+            size_t p = static_cast<size_t>(j) * width + i;
+            double sum_w = 0, sum_l = 0, sum_l2 = 0;
+            for (int dy = -2; dy <= 2; ++dy)
+                for (int dx = -2; dx <= 2; ++dx) {
+                    int x = i + dx, y = j + dy;
+                    if (x < 0 || x >= width || y < 0 || y >= height)
+                        continue;
+                    size_t q = static_cast<size_t>(y) * width + x;
+                    double w = geometry_weight(p, q, dx, dy);
+                    double l = luminance(illumination[q]);
+                    sum_w += w;
+                    sum_l += w * l;
+                    sum_l2 += w * l * l;
+                }
+            double mean = sum_l / sum_w;
+            variance[p] = fmax(0.0, sum_l2 / sum_w - mean * mean);
+        }
+    });
+
+    const double kernel[3] = { 3.0/8, 1.0/4, 1.0/16 };
+    for (int iteration = 0; iteration < settings.iterations; ++iteration) {
+        const int step = 1 << iteration;
+        parallel_rows(height, settings.threads, [&](int j) {
+            for (int i = 0; i < width; ++i) {
+                size_t p = static_cast<size_t>(j) * width + i;
+                if (kind[p] == emitter) {
+                    next[p] = illumination[p];
+                    continue;
+                }
+                double l_p = luminance(illumination[p]);
+                double sigma_l = settings.sigma_luminance * sqrt(variance[p]) + 1e-9;
+                color sum(0, 0, 0);
+                double sum_w = 0, sum_var = 0;
+                for (int dy = -2; dy <= 2; ++dy)
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        int x = i + dx * step, y = j + dy * step;
+                        if (x < 0 || x >= width || y < 0 || y >= height)
+                            continue;
+                        size_t q = static_cast<size_t>(y) * width + x;
+                        double w = kernel[abs(dx)] * kernel[abs(dy)]
+                                 * geometry_weight(p, q, dx * step, dy * step)
+                                 * exp(-fabs(l_p - luminance(illumination[q])) / sigma_l);
+                        sum += w * illumination[q];
+                        sum_w += w;
+                        sum_var += w * w * variance[q];
+                    }
+                // The center tap always has weight, so sum_w > 0.
+                next[p] = sum / sum_w;
+                next_variance[p] = sum_var / (sum_w * sum_w);
+            }
+        });
+        illumination.swap(next);
+        variance.swap(next_variance);
+    }
+
+    parallel_rows(height, settings.threads, [&](int j) {
+        for (int i = 0; i < width; ++i) {
+            size_t p = static_cast<size_t>(j) * width + i;
+            image.at(i, j) = illumination[p] * factor[p] * std::max(1, samples(i, j));
+        }
+    });
+}
+
+#endif
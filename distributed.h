@@ -0,0 +1,343 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "rt.h"
+
+#include "checkpoint.h"
+#include "render.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Distributed rendering of one frame. A coordinator splits the image into
+// jobs of job_size x job_size pixels and hands them to worker processes that
+// connect to it over TCP, one job per worker at a time; each worker renders
+// its job's pixels into its own copy of the frame and sends back their sums.
+// Sample s of pixel (i, j) is seeded from (seed, pixel, s) alone, so a job
+// comes out the same on any worker, and the assembled image is the same as
+// one rendered by a single process.
+//
+// Workers run the same command line as the coordinator (scene, samples,
+// seed, integrator, light sampling) and must agree with it on the render,
+// which they show by sending their checkpoint_info. The job a worker holds
+// when its connection drops is handed to another worker; once no jobs are
+// left, idle workers take copies of the ones still out, so that a worker
+// that hangs or crawls does not hold up the frame. The first copy of a job
+// to come back is kept. Messages are in native byte order, so all machines
+// need the same byte order and the same real.
+//
+// Messages:
+//   worker -> coordinator  hello: distributed_magic, checkpoint_info (with
+//                          samples set to the samples per pixel), int32
+//                          sizeof(real)
+//   coordinator -> worker  job: int32 x0, y0, x1, y1; an empty tile ends
+//                          the session
+//   worker -> coordinator  result: the job's tile, uint64 rays traced, then
+//                          its pixel sums row by row from y0, as colors
+
+static const char distributed_magic[8] = {'R', 'T', 'J', 'O', 'B', 'S', '0', '1'};
+
+struct distributed_hello {
+    char magic[8];
+    checkpoint_info info;
+    int32_t real_size;
+};
+
+// Splits "host:port" into its parts; a bare port leaves host empty.
+inline void split_address(const char* address, std::string& host, std::string& port) {
+    const char* colon = strrchr(address, ':');
+    host = colon ? std::string(address, colon) : std::string();
+    port = colon ? std::string(colon + 1) : std::string(address);
+}
+
+inline bool send_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline size_t tile_pixels(const tile& t) {
+    return static_cast<size_t>(t.x1 - t.x0) * (t.y1 - t.y0);
+}
+
+// Listens on address ("[host:]port") and renders image, which must be
+// cleared, with the workers that connect until every job is done. info
+// describes the render as the workers must see it. Adds the rays the workers
+// traced to rays. Returns false if the address cannot be bound.
+bool coordinate_render(const char* address, const checkpoint_info& info, framebuffer& image,
+                       int job_size, uint64_t& rays) {
+    std::string host, port;
+    split_address(address, host, port);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* found;
+    if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &found) != 0)
+        return false;
+    int listener = -1;
+    for (addrinfo* a = found; a && listener < 0; a = a->ai_next) {
+        listener = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (listener < 0)
+            continue;
+        int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(listener, a->ai_addr, a->ai_addrlen) != 0 || listen(listener, 16) != 0) {
+            close(listener);
+            listener = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (listener < 0)
+        return false;
+    fprintf(stderr, "Coordinator listening on %s\n", address);
+
+    std::vector<tile> jobs = make_tiles(image.width, image.height, job_size);
+    std::deque<int> pending;
+    for (size_t k = 0; k < jobs.size(); ++k)
+        pending.push_back(static_cast<int>(k));
+    std::vector<char> done(jobs.size(), 0);
+    std::vector<int> copies(jobs.size(), 0);       // workers holding each job
+    int remaining = static_cast<int>(jobs.size());
+
+    struct connection {
+        int fd;
+        bool ready;                 // hello accepted
+        int job;                    // index of the job held, or -1
+        std::vector<char> in;       // bytes received and not yet used
+    };
+    std::vector<connection> workers;
+
+    auto drop = [&](size_t k, const char* why) {
+        connection& c = workers[k];
+        if (c.job >= 0 && --copies[c.job] == 0 && !done[c.job]) {
+            pending.push_front(c.job);
+            fprintf(stderr, "\nWorker %s; job (%d,%d)-(%d,%d) re-issued", why, jobs[c.job].x0, jobs[c.job].y0,
+                    jobs[c.job].x1, jobs[c.job].y1);
+        } else if (c.ready || strcmp(why, "lost") != 0) {
+            fprintf(stderr, "\nWorker %s", why);
+        }
+        close(c.fd);
+        workers.erase(workers.begin() + k);
+    };
+
+    while (remaining > 0) {
+        // Hand a job to every idle worker: the next pending one, or else a
+        // copy of the unfinished job the fewest workers hold.
+        for (connection& c : workers) {
+            if (!c.ready || c.job >= 0)
+                continue;
+            int job = -1;
+            if (!pending.empty()) {
+                job = pending.front();
+                pending.pop_front();
+            } else {
+                for (size_t k = 0; k < jobs.size(); ++k)
+                    if (!done[k] && (job < 0 || copies[k] < copies[job]))
+                        job = static_cast<int>(k);
+            }
+            c.job = job;
+            ++copies[job];
+            // A failed send shows up as a closed connection below.
+            send_all(c.fd, &jobs[job], sizeof(tile));
+        }
+
+        std::vector<pollfd> fds(workers.size() + 1);
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (size_t k = 0; k < workers.size(); ++k) {
+            fds[k+1].fd = workers[k].fd;
+            fds[k+1].events = POLLIN;
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0)
+            continue;
+
+        // Walk backwards so that dropping a worker keeps the indices below.
+        for (size_t k = workers.size(); k-- > 0; ) {
+            if (!fds[k+1].revents)
+                continue;
+            connection& c = workers[k];
+            char buffer[65536];
+            ssize_t n = recv(c.fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                drop(k, "lost");
+                continue;
+            }
+            c.in.insert(c.in.end(), buffer, buffer + n);
+
+            if (!c.ready) {
+                if (c.in.size() < sizeof(distributed_hello))
+                    continue;
+                distributed_hello hello;
+                memcpy(&hello, c.in.data(), sizeof(hello));
+                if (memcmp(hello.magic, distributed_magic, sizeof(hello.magic)) != 0
+                    || memcmp(&hello.info, &info, sizeof(info)) != 0 || hello.real_size != sizeof(real)) {
+                    drop(k, "renders a different image; dropped");
+                    continue;
+                }
+                c.ready = true;
+                c.in.erase(c.in.begin(), c.in.begin() + sizeof(hello));
+                fprintf(stderr, "\nWorker joined (%zu connected)", workers.size());
+            }
+
+            if (c.job < 0 || c.in.size() < sizeof(tile) + sizeof(uint64_t))
+                continue;
+            const tile& t = jobs[c.job];
+            size_t size = sizeof(tile) + sizeof(uint64_t) + tile_pixels(t) * sizeof(color);
+            if (c.in.size() < size)
+                continue;
+            if (memcmp(c.in.data(), &t, sizeof(tile)) != 0) {
+                drop(k, "sent a result for another job; dropped");
+                continue;
+            }
+            if (!done[c.job]) {
+                uint64_t job_rays;
+                memcpy(&job_rays, c.in.data() + sizeof(tile), sizeof(job_rays));
+                rays += job_rays;
+                const char* pixels = c.in.data() + sizeof(tile) + sizeof(uint64_t);
+                size_t row = static_cast<size_t>(t.x1 - t.x0) * sizeof(color);
+                for (int j = t.y0; j < t.y1; ++j, pixels += row)
+                    memcpy(&image.at(t.x0, j), pixels, row);
+                done[c.job] = 1;
+                --remaining;
+                fprintf(stderr, "\rJobs remaining: %d, workers: %zu   ", remaining, workers.size());
+            }
+            --copies[c.job];
+            c.job = -1;
+            c.in.erase(c.in.begin(), c.in.begin() + size);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0) {
+                // Lets the kernel notice workers whose machine went away
+                // without closing the connection.
+                int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+                connection c;
+                c.fd = fd;
+                c.ready = false;
+                c.job = -1;
+                workers.push_back(c);
+            }
+        }
+    }
+
+    tile stop = { 0, 0, 0, 0 };
+    for (connection& c : workers) {
+        if (c.ready)
+            send_all(c.fd, &stop, sizeof(stop));
+        close(c.fd);
+    }
+    close(listener);
+    return true;
+}
+
+// Connects to the coordinator at address ("host:port"), retrying for a few
+// seconds while it starts, and renders the jobs it hands out with
+// render(image), image.region set to the job, until it ends the session.
+// info describes the render as coordinate_render() expects it. A worker
+// still rendering a copy of a job when the frame is done finds the
+// connection closed instead, which also ends the session. Returns false if
+// the coordinator cannot be reached or drops the worker before its first job.
+bool run_worker(const char* address, const checkpoint_info& info, framebuffer& image,
+                std::function<uint64_t(framebuffer&)> render) {
+    std::string host, port;
+    split_address(address, host, port);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < 50; ++attempt) {
+        if (attempt > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        addrinfo* found;
+        if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &found) != 0)
+            continue;
+        for (addrinfo* a = found; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Could not connect to %s\n", address);
+        return false;
+    }
+
+    distributed_hello hello;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, distributed_magic, sizeof(hello.magic));
+    hello.info = info;
+    hello.real_size = sizeof(real);
+    bool ok = send_all(fd, &hello, sizeof(hello));
+
+    tile t;
+    std::vector<color> pixels;
+    int jobs = 0;
+    while (ok && (ok = recv_all(fd, &t, sizeof(t))) && t.x1 > t.x0) {
+        if (t.x0 < 0 || t.y0 < 0 || t.x1 > image.width || t.y1 > image.height || t.y1 <= t.y0) {
+            ok = false;
+            break;
+        }
+        // render() adds to the sums in image, which start from zero.
+        pixels.clear();
+        for (int j = t.y0; j < t.y1; ++j)
+            for (int i = t.x0; i < t.x1; ++i)
+                image.at(i, j) = color(0, 0, 0);
+        image.region = t;
+        uint64_t rays = render(image);
+        for (int j = t.y0; j < t.y1; ++j)
+            pixels.insert(pixels.end(), &image.at(t.x0, j), &image.at(t.x0, j) + (t.x1 - t.x0));
+        ok = send_all(fd, &t, sizeof(t)) && send_all(fd, &rays, sizeof(rays))
+          && send_all(fd, pixels.data(), pixels.size() * sizeof(color));
+        fprintf(stderr, "Job (%d,%d)-(%d,%d) done, %llu rays\n", t.x0, t.y0, t.x1, t.y1,
+                static_cast<unsigned long long>(rays));
+        ++jobs;
+    }
+    close(fd);
+    if (ok || jobs > 0)
+        fprintf(stderr, "Session ended after %d jobs\n", jobs);
+    else
+        fprintf(stderr, "Dropped by the coordinator at %s\n", address);
+    return ok || jobs > 0;
+}
+
+#endif
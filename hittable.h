@@ -2,25 +2,112 @@
 #define HITTABLE_H
 
 #include "rt.h"
+#include "aabb.h"
+#include "ray_packet.h"
 
 class material;
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
-    double t;
+    const material* mat_ptr; // owned by the scene's material_table
+    real t;
     bool front_face;
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal :-outward_normal;
     }
+
+    // Origin for a ray leaving the hit in direction dir. In single precision
+    // p may lie a few ulps on either side of the surface, more than
+    // hit_epsilon far from the origin, so it is pushed off the surface
+    // along the normal, to the side dir points to, by an amount relative to
+    // the size of p.
+    inline point3 spawn_origin(const vec3& dir) const {
+#ifdef RT_FLOAT
+        real size = fmax(fabs(p.x()), fmax(fabs(p.y()), fabs(p.z())));
+        real offset = spawn_epsilon * (1 + size);
+        return p + (dot(dir, normal) < 0 ? -offset : offset) * normal;
+#else
+        (void)dir;
+        return p;
+#endif
+    }
 };
 
 class hittable {
     public:
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+        // True for scene types whose primitives and materials come from a
+        // closed set; integrators then dispatch materials without virtual calls.
+        static const bool closed_set = false;
+
+        virtual ~hittable() = default;
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+        virtual bool bounding_box(aabb& output_box) const = 0;
+
+        // True if r meets the object between t_min and t_max. Visibility
+        // queries such as shadow rays need no more than that, so objects
+        // return on the first hit they find, without the closest one or its
+        // record.
+        virtual bool occluded(const ray& r, real t_min, real t_max) const {
+            hit_record rec;
+            return hit(r, t_min, t_max, rec);
+        }
+
+        // Sampling of the object as an area light. random() returns a vector
+        // from origin to a point drawn uniformly over the surface, and
+        // pdf_value() the density, per unit solid angle at origin, with which
+        // that picks direction v. Objects that cannot be sampled keep the
+        // zero density.
+        virtual double pdf_value(const point3& origin, const vec3& v) const { return 0.0; }
+        virtual vec3 random(const point3& origin, rng& gen) const { return vec3(1, 0, 0); }
+
+        // Closest hits of the rays of a prepared packet in the mask active,
+        // beyond t_min and below each ray's packet.t_max, which is lowered to
+        // the hit. Returns the mask of rays that hit, with their records in
+        // recs. Hierarchies trace the rays together; anything else traces
+        // them one by one.
+        virtual int hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const {
+            int hits = 0;
+            for (int k = 0; k < packet.count; k++) {
+                if (((active >> k) & 1) && hit(packet.rays[k], t_min, packet.t_max[k], recs[k])) {
+                    hits |= 1 << k;
+                    packet.t_max[k] = recs[k].t;
+                }
+            }
+            return hits;
+        }
+
+        // Any-hit form of hit_packet(): the mask of rays in active that meet
+        // the object between t_min and their packet.t_max.
+        virtual int occluded_packet(const ray_packet& packet, real t_min, int active) const {
+            int blocked = 0;
+            for (int k = 0; k < packet.count; k++)
+                if (((active >> k) & 1) && occluded(packet.rays[k], t_min, packet.t_max[k]))
+                    blocked |= 1 << k;
+            return blocked;
+        }
 };
 
+// Any-hit queries for rays [0, n), each between t_min and its own t_max[k],
+// traced in packets of consecutive rays. Sets blocked[k] to whether ray k
+// meets anything in world.
+template <typename World>
+void occluded_batch(const World& world, const ray* rays, const real* t_max, size_t n, real t_min, char* blocked) {
+    ray_packet packet;
+    for (size_t first = 0; first < n; first += max_packet_size) {
+        packet.clear();
+        for (size_t k = first; k < std::min(n, first + max_packet_size); k++) {
+            packet.add(rays[k]);
+            packet.t_max[packet.count - 1] = t_max[k];
+        }
+        packet.prepare();
+        int mask = world.occluded_packet(packet, t_min, packet.all());
+        for (int k = 0; k < packet.count; k++)
+            blocked[first + k] = (mask >> k) & 1;
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,368 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "rt.h"
+
+#include "color.h"
+#include "render.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class image_format { p3, p6, pfm, png };
+
+// Picks the format from a file name's extension; ppm maps to P6.
+inline bool format_from_name(const char* name, image_format& format) {
+    const char* dot = strrchr(name, '.');
+    if (!dot)
+        return false;
+    if (!strcmp(dot, ".ppm"))
+        format = image_format::p6;
+    else if (!strcmp(dot, ".pfm"))
+        format = image_format::pfm;
+    else if (!strcmp(dot, ".png"))
+        format = image_format::png;
+    else
+        return false;
+    return true;
+}
+
+// Encodes a framebuffer of sample sums into one in-memory file, which is then
+// written with a single fwrite. The encoder runs on its own thread: a
+// renderer reports finished tiles through tile_done(), and each scanline is
+// tone-mapped and encoded as soon as all of its tiles are in, overlapping
+// with the tiles still rendering. Rows not reported by the time finish() is
+// called are encoded then.
+//
+// P3 and P6 hold the tone-mapped 8-bit values of write_color(), PFM the linear
+// averages as 32-bit floats, and PNG the 8-bit values in stored (uncompressed)
+// deflate blocks, so no zlib is needed.
+class image_writer {
+    public:
+        image_writer(const framebuffer& fb, image_format f, std::function<int(int, int)> samples)
+            : image(fb), format(f), sample_count(samples), rows_done(fb.height, 0),
+              next_row(0), finishing(false), in_chunk(false) {}
+        ~image_writer() { stop(); }
+
+        // Starts the encoder thread; without it everything is encoded in finish().
+        void start();
+
+        // Thread-safe; called by the workers as tiles are finished.
+        void tile_done(const tile& t);
+
+        // Encodes whatever is left and writes the file to out.
+        bool finish(FILE* out);
+
+    private:
+        void run();
+        void stop();
+        void mark(const tile& t);
+        void begin();
+        void emit_ready_rows();
+        void emit_row(int j);
+        void end();
+
+        // Rows are emitted top to bottom. PFM rows have a fixed size, so they
+        // are written in place as soon as they are done instead.
+        int row_at(int r) const { return image.height-1 - r; }
+
+        void put(const void* data, size_t n);
+        void put_u32(uint32_t x);
+        void put_deflate(const unsigned char* data, size_t n);
+        void begin_chunk(const char* type);
+        void end_chunk();
+
+        static uint32_t crc32(uint32_t crc, const unsigned char* data, size_t n);
+
+    private:
+        const framebuffer& image;
+        image_format format;
+        std::function<int(int, int)> sample_count;
+
+        std::thread encoder;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<tile> finished;
+        std::vector<int> rows_done;     // pixels finished per framebuffer row
+        int next_row;                   // next row to emit, in output order
+        std::vector<bool> row_written;  // PFM rows already in place
+        size_t header_size;
+        bool finishing;
+
+        std::vector<unsigned char> out;
+        size_t chunk_start;             // PNG chunk being written
+        bool in_chunk;
+        uint32_t chunk_crc;             // of the chunk's type and data so far
+        size_t deflate_left;            // raw bytes left in the zlib stream
+        size_t block_left;              // raw bytes left in the current stored block
+        uint32_t adler_a, adler_b;
+};
+
+void image_writer::start() {
+    begin();
+    encoder = std::thread(&image_writer::run, this);
+}
+
+void image_writer::tile_done(const tile& t) {
+    std::lock_guard<std::mutex> guard(lock);
+    finished.push_back(t);
+    wake.notify_one();
+}
+
+bool image_writer::finish(FILE* output) {
+    if (encoder.joinable()) {
+        stop();
+    } else {
+        begin();
+        for (int j = 0; j < image.height; ++j)
+            rows_done[j] = image.width;
+        emit_ready_rows();
+    }
+    end();
+    return fwrite(out.data(), 1, out.size(), output) == out.size() && fflush(output) == 0;
+}
+
+void image_writer::stop() {
+    if (!encoder.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        finishing = true;
+        wake.notify_one();
+    }
+    encoder.join();
+}
+
+void image_writer::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        wake.wait(guard, [this] { return finishing || !finished.empty(); });
+        std::deque<tile> batch;
+        batch.swap(finished);
+        bool last = finishing;
+
+        guard.unlock();
+        for (const tile& t : batch)
+            mark(t);
+        if (last) {
+            for (int j = 0; j < image.height; ++j)
+                rows_done[j] = image.width;
+        }
+        emit_ready_rows();
+        guard.lock();
+
+        if (last)
+            return;
+    }
+}
+
+void image_writer::mark(const tile& t) {
+    for (int j = t.y0; j < t.y1; ++j)
+        rows_done[j] += t.x1 - t.x0;
+}
+
+void image_writer::emit_ready_rows() {
+    if (format == image_format::pfm) {
+        for (int j = 0; j < image.height; ++j) {
+            if (!row_written[j] && rows_done[j] >= image.width) {
+                emit_row(j);
+                row_written[j] = true;
+            }
+        }
+        return;
+    }
+    while (next_row < image.height && rows_done[row_at(next_row)] >= image.width)
+        emit_row(row_at(next_row++));
+}
+
+void image_writer::begin() {
+    char header[64];
+    int n;
+    switch (format) {
+        case image_format::p3:
+            out.reserve(static_cast<size_t>(image.width) * image.height * 12 + 32);
+            n = snprintf(header, sizeof(header), "P3\n%d %d\n255\n", image.width, image.height);
+            put(header, n);
+            break;
+        case image_format::p6:
+            out.reserve(static_cast<size_t>(image.width) * image.height * 3 + 32);
+            n = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", image.width, image.height);
+            put(header, n);
+            break;
+        case image_format::pfm:
+            // A negative scale marks little-endian floats; rows are stored
+            // bottom to top.
+            n = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", image.width, image.height);
+            put(header, n);
+            header_size = n;
+            out.resize(header_size + static_cast<size_t>(image.width) * image.height * 3 * sizeof(float));
+            row_written.assign(image.height, false);
+            break;
+        case image_format::png: {
+            size_t raw = static_cast<size_t>(image.height) * (1 + 3 * image.width);
+            out.reserve(raw + raw / 65535 * 5 + 128);
+            static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+            put(signature, sizeof(signature));
+
+            begin_chunk("IHDR");
+            put_u32(image.width);
+            put_u32(image.height);
+            const unsigned char ihdr[5] = {8, 2, 0, 0, 0}; // 8-bit RGB, no interlace
+            put(ihdr, sizeof(ihdr));
+            end_chunk();
+
+            // One IDAT chunk holding the whole zlib stream: the header for
+            // deflate with no compression, stored blocks, then adler32.
+            begin_chunk("IDAT");
+            const unsigned char zlib_header[2] = {0x78, 0x01};
+            put(zlib_header, sizeof(zlib_header));
+            deflate_left = raw;
+            block_left = 0;
+            adler_a = 1;
+            adler_b = 0;
+            break;
+        }
+    }
+}
+
+void image_writer::emit_row(int j) {
+    const int width = image.width;
+    if (format == image_format::pfm) {
+        std::vector<float> row(3 * width);
+        for (int i = 0; i < width; ++i) {
+            double scale = 1.0 / sample_count(i, j);
+            const color& c = image.at(i, j);
+            for (int k = 0; k < 3; ++k)
+                row[3*i + k] = static_cast<float>(c[k] * scale);
+        }
+        memcpy(&out[header_size + static_cast<size_t>(j) * row.size() * sizeof(float)],
+               row.data(), row.size() * sizeof(float));
+        return;
+    }
+
+    std::vector<unsigned char> row;
+    row.reserve(format == image_format::p3 ? 12 * width : 1 + 3 * width);
+    if (format == image_format::png)
+        row.push_back(0);  // filter type: none
+    for (int i = 0; i < width; ++i) {
+        int rgb[3];
+        tone_map(image.at(i, j), sample_count(i, j), rgb);
+        if (format == image_format::p3) {
+            char text[16];
+            int n = snprintf(text, sizeof(text), "%d %d %d\n", rgb[0], rgb[1], rgb[2]);
+            row.insert(row.end(), text, text + n);
+        } else {
+            for (int k = 0; k < 3; ++k)
+                row.push_back(static_cast<unsigned char>(rgb[k]));
+        }
+    }
+
+    if (format == image_format::png)
+        put_deflate(row.data(), row.size());
+    else
+        put(row.data(), row.size());
+}
+
+void image_writer::end() {
+    if (format != image_format::png)
+        return;
+    put_u32((adler_b << 16) | adler_a);
+    end_chunk();
+    begin_chunk("IEND");
+    end_chunk();
+}
+
+void image_writer::put(const void* data, size_t n) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    out.insert(out.end(), bytes, bytes + n);
+    if (in_chunk)
+        chunk_crc = crc32(chunk_crc, bytes, n);
+}
+
+void image_writer::put_u32(uint32_t x) {
+    const unsigned char bytes[4] = {
+        static_cast<unsigned char>(x >> 24), static_cast<unsigned char>(x >> 16),
+        static_cast<unsigned char>(x >> 8), static_cast<unsigned char>(x)};
+    put(bytes, sizeof(bytes));
+}
+
+// Appends raw bytes to the zlib stream, opening a new stored block every
+// 65535 bytes; the total is known up front, so the last block is flagged
+// final as it is opened.
+void image_writer::put_deflate(const unsigned char* data, size_t n) {
+    // 5552 bytes is the most adler32 can sum before the modulo is needed.
+    for (size_t k = 0; k < n; ) {
+        size_t stop = std::min(n, k + 5552);
+        for (; k < stop; ++k) {
+            adler_a += data[k];
+            adler_b += adler_a;
+        }
+        adler_a %= 65521;
+        adler_b %= 65521;
+    }
+
+    while (n > 0) {
+        if (block_left == 0) {
+            block_left = std::min<size_t>(deflate_left, 65535);
+            unsigned char header[5];
+            header[0] = block_left == deflate_left ? 1 : 0;
+            header[1] = static_cast<unsigned char>(block_left);
+            header[2] = static_cast<unsigned char>(block_left >> 8);
+            header[3] = static_cast<unsigned char>(~block_left);
+            header[4] = static_cast<unsigned char>(~block_left >> 8);
+            put(header, sizeof(header));
+        }
+        size_t take = std::min(n, block_left);
+        put(data, take);
+        data += take;
+        n -= take;
+        block_left -= take;
+        deflate_left -= take;
+    }
+}
+
+void image_writer::begin_chunk(const char* type) {
+    chunk_start = out.size();
+    put_u32(0);  // length, patched in end_chunk()
+    in_chunk = true;
+    chunk_crc = 0;
+    put(type, 4);
+}
+
+void image_writer::end_chunk() {
+    in_chunk = false;
+    size_t length = out.size() - chunk_start - 8;
+    for (int k = 0; k < 4; ++k)
+        out[chunk_start + k] = static_cast<unsigned char>(length >> (24 - 8*k));
+    put_u32(chunk_crc);
+}
+
+uint32_t image_writer::crc32(uint32_t crc, const unsigned char* data, size_t n) {
+    struct crc_table {
+        uint32_t entry[256];
+        crc_table() {
+            for (uint32_t k = 0; k < 256; ++k) {
+                uint32_t c = k;
+                for (int bit = 0; bit < 8; ++bit)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                entry[k] = c;
+            }
+        }
+    };
+    static const crc_table table;
+
+    crc = ~crc;
+    for (size_t k = 0; k < n; ++k)
+        crc = table.entry[(crc ^ data[k]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "rt.h"
+
+#include "aabb.h"
+#include "hittable.h"
+
+// Affine transform stored as the top three rows of a 4x4 matrix.
+class transform {
+    public:
+        transform() {
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 4; j++)
+                    m[i][j] = (i == j) ? 1.0 : 0.0;
+        }
+
+        static transform translate(const vec3& d) {
+            transform t;
+            for (int i = 0; i < 3; i++)
+                t.m[i][3] = d[i];
+            return t;
+        }
+
+        static transform scale(const vec3& s) {
+            transform t;
+            for (int i = 0; i < 3; i++)
+                t.m[i][i] = s[i];
+            return t;
+        }
+
+        static transform scale(real s) {
+            return scale(vec3(s, s, s));
+        }
+
+        // Rotation by the given angle in degrees around an axis through the origin.
+        static transform rotate(const vec3& axis, real degrees) {
+            vec3 a = unit_vector(axis);
+            real theta = degrees_to_radians(degrees);
+            real c = cos(theta), s = sin(theta), k = 1 - c;
+
+            transform t;
+            t.m[0][0] = a.x()*a.x()*k + c;
+            t.m[0][1] = a.x()*a.y()*k - a.z()*s;
+            t.m[0][2] = a.x()*a.z()*k + a.y()*s;
+            t.m[1][0] = a.y()*a.x()*k + a.z()*s;
+            t.m[1][1] = a.y()*a.y()*k + c;
+            t.m[1][2] = a.y()*a.z()*k - a.x()*s;
+            t.m[2][0] = a.z()*a.x()*k - a.y()*s;
+            t.m[2][1] = a.z()*a.y()*k + a.x()*s;
+            t.m[2][2] = a.z()*a.z()*k + c;
+            return t;
+        }
+
+        point3 apply_point(const point3& p) const {
+            return point3(
+                m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+        }
+
+        vec3 apply_vector(const vec3& v) const {
+            return vec3(
+                m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+        }
+
+        // Applies the transpose of the linear part. Normals are carried to
+        // world space by the transpose of the world-to-object transform.
+        vec3 apply_transpose(const vec3& v) const {
+            return vec3(
+                m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+        }
+
+        aabb apply_box(const aabb& box) const {
+            aabb result;
+            for (int i = 0; i < 8; i++) {
+                point3 corner(
+                    (i & 1) ? box.maximum.x() : box.minimum.x(),
+                    (i & 2) ? box.maximum.y() : box.minimum.y(),
+                    (i & 4) ? box.maximum.z() : box.minimum.z());
+                result.expand(apply_point(corner));
+            }
+            return result;
+        }
+
+        transform inverse() const;
+
+    public:
+        real m[3][4];
+};
+
+// Composition: (a * b) applies b first, then a.
+inline transform operator*(const transform& a, const transform& b) {
+    transform t;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            t.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+            if (j == 3)
+                t.m[i][j] += a.m[i][3];
+        }
+    }
+    return t;
+}
+
+transform transform::inverse() const {
+    // Invert the linear part by its adjugate, then the translation.
+    real det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+               - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+               + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    real inv_det = 1.0 / det;
+
+    transform t;
+    t.m[0][0] =  (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+    t.m[0][1] = -(m[0][1]*m[2][2] - m[0][2]*m[2][1]) * inv_det;
+    t.m[0][2] =  (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+    t.m[1][0] = -(m[1][0]*m[2][2] - m[1][2]*m[2][0]) * inv_det;
+    t.m[1][1] =  (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+    t.m[1][2] = -(m[0][0]*m[1][2] - m[0][2]*m[1][0]) * inv_det;
+    t.m[2][0] =  (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+    t.m[2][1] = -(m[0][0]*m[2][1] - m[0][1]*m[2][0]) * inv_det;
+    t.m[2][2] =  (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+    vec3 d = t.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+    for (int i = 0; i < 3; i++)
+        t.m[i][3] = -d[i];
+    return t;
+}
+
+// A placement of shared geometry. The object is usually a bvh built once per
+// unique piece of geometry (the bottom level); a bvh over many instances then
+// forms the top level, and moving an instance only requires rebuilding that.
+class instance : public hittable {
+    public:
+        instance() : mat_override(nullptr) {}
+        instance(shared_ptr<hittable> obj, const transform& to_world, const material* m = nullptr)
+            : object(obj), mat_override(m) { set_transform(to_world); }
+
+        void set_transform(const transform& to_world) {
+            object_to_world = to_world;
+            world_to_object = to_world.inverse();
+        }
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual int occluded_packet(const ray_packet& packet, real t_min, int active) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
+
+    private:
+        ray to_object(const ray& r) const;
+        void to_world(const ray& r, hit_record& rec) const;
+        void to_object(const ray_packet& packet, int active, ray_packet& local, int* lane) const;
+
+    public:
+        shared_ptr<hittable> object;
+        transform object_to_world;
+        transform world_to_object;
+        const material* mat_override; // replaces the object's material if set
+};
+
+// The direction is not renormalized, so t is the same in both spaces.
+ray instance::to_object(const ray& r) const {
+    return ray(world_to_object.apply_point(r.origin()), world_to_object.apply_vector(r.direction()));
+}
+
+// Takes a hit on the object back to world space.
+void instance::to_world(const ray& r, hit_record& rec) const {
+    // Affine maps keep the sign of dot(normal, direction), so front_face holds.
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(world_to_object.apply_transpose(rec.normal));
+    if (mat_override)
+        rec.mat_ptr = mat_override;
+}
+
+bool instance::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!object->hit(to_object(r), t_min, t_max, rec))
+        return false;
+
+    to_world(r, rec);
+    return true;
+}
+
+// The active rays of packet, taken to object space, as a packet of their
+// own; lane[m] is the ray of packet that ray m of local stands for.
+void instance::to_object(const ray_packet& packet, int active, ray_packet& local, int* lane) const {
+    for (int k = 0; k < packet.count; k++) {
+        if ((active >> k) & 1) {
+            lane[local.count] = k;
+            local.add(to_object(packet.rays[k]));
+            local.t_max[local.count - 1] = packet.t_max[k];
+        }
+    }
+    if (local.count > 0)
+        local.prepare();
+}
+
+int instance::hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const {
+    ray_packet local;
+    int lane[max_packet_size];
+    to_object(packet, active, local, lane);
+    if (local.count == 0)
+        return 0;
+
+    hit_record local_recs[max_packet_size];
+    int local_hits = object->hit_packet(local, t_min, local_recs, local.all());
+    int hits = 0;
+    for (int m = 0; m < local.count; m++) {
+        if ((local_hits >> m) & 1) {
+            int k = lane[m];
+            recs[k] = local_recs[m];
+            to_world(packet.rays[k], recs[k]);
+            packet.t_max[k] = local.t_max[m];
+            hits |= 1 << k;
+        }
+    }
+    return hits;
+}
+
+bool instance::occluded(const ray& r, real t_min, real t_max) const {
+    return object->occluded(to_object(r), t_min, t_max);
+}
+
+int instance::occluded_packet(const ray_packet& packet, real t_min, int active) const {
+    ray_packet local;
+    int lane[max_packet_size];
+    to_object(packet, active, local, lane);
+    if (local.count == 0)
+        return 0;
+
+    int local_blocked = object->occluded_packet(local, t_min, local.all());
+    int blocked = 0;
+    for (int m = 0; m < local.count; m++)
+        if ((local_blocked >> m) & 1)
+            blocked |= 1 << lane[m];
+    return blocked;
+}
+
+bool instance::bounding_box(aabb& output_box) const {
+    aabb box;
+    if (!object->bounding_box(box))
+        return false;
+    output_box = object_to_world.apply_box(box);
+    return true;
+}
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "rt.h"
+
+#include "adaptive.h"
+#include "camera.h"
+#include "checkpoint.h"
+#include "color.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "path_tracer.h"
+#include "render.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+// Whether rays that leave the scene see black instead of the sky; set from
+// the scene being rendered.
+bool black_background = false;
+
+color background(const ray& r) {
+    if(black_background)
+        return color(0,0,0);
+    vec3 unit_direction = unit_vector(r.direction());
+    auto t = 0.5*(unit_direction.y() + 1.0);
+    return (1.0-t)*color(1.0, 1.0, 1.0) + t*color(0.5, 0.7, 1.0);
+}
+
+// Whether ray_color() stops a branch whose attenuation has fallen this low.
+inline bool below_cutoff(const color& attenuation) {
+    return (attenuation.x() <= 0.01) &&
+           (attenuation.y() <= 0.01) &&
+           (attenuation.z() <= 0.01);
+}
+
+template <typename World>
+color ray_color(const ray& r, const World& world, int depth, color prev_attenuation, rng& gen,
+                const light_list* lights = nullptr, double bsdf_pdf = 0);
+
+// Rest of ray_color() once r has been intersected with the world. Lights and
+// bsdf_pdf add next-event estimation as in scatter_path(); light is sampled
+// only where the reflected branch would be followed.
+template <typename World>
+color ray_color_hit(const ray& r, bool hit, const hit_record& rec, const World& world, int depth,
+                    color prev_attenuation, rng& gen, const light_list* lights = nullptr, double bsdf_pdf = 0) {
+    const bool closed = World::closed_set;
+    if (hit) {
+        color tmp_color(0, 0, 0);
+        ray scattered;
+        color attenuation;
+        const material* mat = rec.mat_ptr;
+        const bool diffuse = lights && mat->kind == material_kind::lambertian;
+        if (diffuse) {
+            const color& albedo = static_cast<const lambertian*>(mat)->albedo;
+            if (depth > 1 && !below_cutoff(albedo * prev_attenuation))
+                tmp_color += direct_light(world, *lights, rec, albedo, gen);
+        }
+        STAT(int scattered_rays = 0);
+        if (mat->is_reflect && dispatch_reflect_ray<closed>(mat, r, rec, attenuation, scattered, gen)) {
+            STAT(++scattered_rays);
+            double pdf = diffuse ? lambertian_pdf(rec.normal, scattered.direction()) : 0;
+            tmp_color += attenuation * ray_color(scattered, world, depth-1, attenuation * prev_attenuation, gen,
+                                                 lights, pdf);
+        }
+        if (mat->is_refract && dispatch_refract_ray<closed>(mat, r, rec, attenuation, scattered, gen)) {
+            STAT(++scattered_rays);
+            tmp_color += attenuation * ray_color(scattered, world, depth-1, attenuation * prev_attenuation, gen,
+                                                 lights);
+        }
+        if (mat->is_light) {
+            color emission = dispatch_emitted<closed>(mat);
+            if (bsdf_pdf > 0)
+                emission *= power_heuristic(bsdf_pdf, lights->pdf_value(r.origin(), r.direction()));
+            tmp_color += emission;
+        }
+        STAT(thread_stats.secondary_rays[static_cast<int>(mat->kind)] += scattered_rays);
+        STAT(if (!scattered_rays) ++thread_stats.ended_absorbed);
+        
+        return tmp_color;
+    }
+
+    STAT(++thread_stats.ended_escaped);
+    return background(r);
+}
+
+// Splitting integrator: follows both the reflected and the refracted ray at
+// every hit, so a dielectric doubles the work per bounce.
+template <typename World>
+color ray_color(const ray& r, const World& world, int depth, color prev_attenuation, rng& gen,
+                const light_list* lights, double bsdf_pdf) {
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (depth <= 0) {
+        STAT(++thread_stats.ended_depth);
+        return color(0,0,0);
+    }
+    if (below_cutoff(prev_attenuation)) {
+        STAT(++thread_stats.ended_cutoff);
+        return color(0,0,0);
+    }
+
+    hit_record rec;
+    ++rays_traced;
+    bool hit = world.hit(r, hit_epsilon, infinity, rec);
+    return ray_color_hit(r, hit, rec, world, depth, prev_attenuation, gen, lights, bsdf_pdf);
+}
+
+// Rest of path_color() once r has been intersected with the world; see
+// scatter_path() for lights.
+template <typename World>
+color path_color_hit(ray r, bool hit, hit_record rec, const World& world, int max_depth, rng& gen,
+                     const light_list* lights = nullptr) {
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    double bsdf_pdf = 0;
+
+    for (int bounce = 0; ; ) {
+        if (!hit) {
+            radiance += throughput * background(r);
+            STAT(++thread_stats.ended_escaped);
+            return radiance;
+        }
+
+        if (!scatter_path<World::closed_set>(world, lights, r, rec, bounce, max_depth, throughput, radiance,
+                                             bsdf_pdf, gen))
+            return radiance;
+        if (++bounce >= max_depth)
+            break;
+
+        ++rays_traced;
+        hit = world.hit(r, hit_epsilon, infinity, rec);
+    }
+
+    STAT(++thread_stats.ended_depth);
+    return radiance;
+}
+
+// Single-path integrator: estimates the same sum as ray_color, but follows one
+// scattered ray per hit, chosen with probability proportional to its
+// attenuation (the Fresnel split for a dielectric) and weighted by the inverse
+// of that probability. After a few bounces paths are ended by Russian roulette
+// on their throughput, so a sample costs at most max_depth rays.
+template <typename World>
+color path_color(const ray& r, const World& world, int max_depth, rng& gen) {
+    hit_record rec;
+    ++rays_traced;
+    bool hit = world.hit(r, hit_epsilon, infinity, rec);
+    return path_color_hit(r, hit, rec, world, max_depth, gen);
+}
+
+enum class integrator { split, path, wavefront };
+
+struct render_settings {
+    integrator method;
+    int first_sample;       // render_image() adds samples [first_sample,
+    int samples_per_pixel;  // first_sample + samples_per_pixel) to the sums
+    int max_depth;
+    int threads;
+    int tile_size;
+    int packet_size;        // camera rays traced together: 0 (one by one), 4, 8 or 16
+    const light_list* lights;   // sampled directly at diffuse hits if set (next-event estimation)
+    uint64_t seed;
+    sample_sequence sequence;   // of the numbers each sample draws; see rng
+};
+
+// Camera ray of sample s of pixel (i, j), with gen set to the sample's
+// stream. Seeded from (pixel, sample); the path draws its bounces from the
+// same stream, so the result is independent of thread and tile order.
+inline ray camera_ray(const camera& cam, const framebuffer& image, uint64_t seed, sample_sequence sequence,
+                      int i, int j, int s, rng& gen) {
+    gen = rng(seed, j*image.width + i, s, sequence);
+    auto u = (i + random_double(gen)) / (image.width-1);
+    auto v = (j + random_double(gen)) / (image.height-1);
+    STAT(++thread_stats.camera_rays);
+    return cam.get_ray(u, v, gen);
+}
+
+// Radiance of camera ray r given its first intersection, which rays_traced
+// already counts.
+template <typename World>
+color shade_sample(const World& world, const render_settings& settings, const ray& r, bool hit,
+                   const hit_record& rec, rng& gen) {
+    STAT(uint64_t rays_before = rays_traced - 1);
+    color c = settings.method == integrator::split
+            ? ray_color_hit(r, hit, rec, world, settings.max_depth, color(1.0, 1.0, 1.0), gen, settings.lights)
+            : path_color_hit(r, hit, rec, world, settings.max_depth, gen, settings.lights);
+    STAT(stat_path_length(rays_traced - rays_before));
+    return c;
+}
+
+// Sample s of pixel (i, j).
+template <typename World>
+color trace_sample(const World& world, const camera& cam, const framebuffer& image,
+                   const render_settings& settings, int i, int j, int s) {
+    rng gen;
+    ray r = camera_ray(cam, image, settings.seed, settings.sequence, i, j, s, gen);
+    hit_record rec;
+    ++rays_traced;
+    bool hit = world.hit(r, hit_epsilon, infinity, rec);
+    return shade_sample(world, settings, r, hit, rec, gen);
+}
+
+// Renders tile t as render_tiles() would, but traces the camera rays of
+// blocks of 2x2, 4x2 or 4x4 pixels as one packet per sample. The paths then
+// go on one by one from their first hits, with the same streams, so the
+// image is the same as without packets.
+template <typename World>
+void render_packet_tile(framebuffer& image, const World& world, const camera& cam,
+                        const render_settings& settings, const tile& t) {
+    const int block_width = settings.packet_size >= 8 ? 4 : 2;
+    const int block_height = settings.packet_size / block_width;
+    const int end = settings.first_sample + settings.samples_per_pixel;
+
+    ray_packet packet;
+    hit_record recs[max_packet_size];
+    rng gens[max_packet_size];
+    color sums[max_packet_size];
+    int xs[max_packet_size], ys[max_packet_size];
+
+    for (int y = t.y1; y > t.y0; y -= block_height) {
+        for (int x = t.x0; x < t.x1; x += block_width) {
+            STAT(uint64_t work = thread_stats.work());
+            int n = 0;
+            for (int j = y-1; j >= std::max(y - block_height, t.y0); --j)
+                for (int i = x; i < std::min(x + block_width, t.x1); ++i) {
+                    xs[n] = i;
+                    ys[n] = j;
+                    sums[n++] = image.at(i, j);
+                }
+
+            for (int s = settings.first_sample; s < end; ++s) {
+                packet.clear();
+                for (int k = 0; k < n; ++k)
+                    packet.add(camera_ray(cam, image, settings.seed, settings.sequence, xs[k], ys[k], s, gens[k]));
+                packet.prepare();
+                rays_traced += n;
+                int hits = world.hit_packet(packet, hit_epsilon, recs, packet.all());
+                for (int k = 0; k < n; ++k)
+                    sums[k] += shade_sample(world, settings, packet.rays[k], (hits >> k) & 1, recs[k], gens[k]);
+            }
+
+            for (int k = 0; k < n; ++k)
+                image.at(xs[k], ys[k]) = sums[k];
+            // The packet is shared by the block, so its cost is spread
+            // evenly over its pixels.
+            STAT(work = (thread_stats.work() - work) / n);
+            STAT(for (int k = 0; k < n; ++k) stat_pixel_cost(xs[k], ys[k], work));
+        }
+    }
+}
+
+template <typename World>
+uint64_t render_image(framebuffer& image, const World& world, const camera& cam, const render_settings& settings) {
+    if (settings.method == integrator::wavefront) {
+        std::vector<std::unique_ptr<wavefront_tracer<World>>> tracers;
+        for (int k = worker_count(image, settings.threads, settings.tile_size); k > 0; --k)
+            tracers.emplace_back(new wavefront_tracer<World>(world, cam, background, settings.max_depth, settings.lights));
+        return render_tile_blocks(image, settings.threads, settings.tile_size, [&](int worker, const tile& t) {
+            STAT(uint64_t work = thread_stats.work());
+            tracers[worker]->render_tile(image, t, settings.first_sample, settings.samples_per_pixel,
+                                         settings.seed, settings.sequence);
+            // Paths of a tile are traced together, so their cost is spread
+            // evenly over its pixels.
+            STAT(work = (thread_stats.work() - work) / ((t.x1 - t.x0) * (t.y1 - t.y0)));
+            STAT(for (int j = t.y0; j < t.y1; ++j) for (int i = t.x0; i < t.x1; ++i) stat_pixel_cost(i, j, work));
+        });
+    }
+
+    if (settings.packet_size > 0) {
+        return render_tile_blocks(image, settings.threads, settings.tile_size, [&](int, const tile& t) {
+            render_packet_tile(image, world, cam, settings, t);
+        });
+    }
+
+    return render_tiles(image, settings.threads, settings.tile_size, [&](int i, int j) {
+        color pixel_color = image.at(i, j);
+        int end = settings.first_sample + settings.samples_per_pixel;
+        for (int s = settings.first_sample; s < end; ++s)
+            pixel_color += trace_sample(world, cam, image, settings, i, j, s);
+        return pixel_color;
+    });
+}
+
+// Adds passes of pass_samples samples per pixel to the sums in image until
+// every pixel has target samples, saving a checkpoint after each pass when a
+// path is given. progress holds the samples already in image.
+template <typename World>
+uint64_t render_progressive(framebuffer& image, const World& world, const camera& cam,
+                            render_settings settings, checkpoint_info& progress,
+                            int target, int pass_samples, const char* checkpoint_path) {
+    uint64_t rays = 0;
+    while (progress.samples < target) {
+        settings.first_sample = progress.samples;
+        settings.samples_per_pixel = std::min(pass_samples, target - progress.samples);
+        rays += render_image(image, world, cam, settings);
+        progress.samples += settings.samples_per_pixel;
+
+        fprintf(stderr, "\nPass done: %d/%d samples per pixel", progress.samples, target);
+        if (checkpoint_path && !save_checkpoint(checkpoint_path, progress, image))
+            fprintf(stderr, "\nCould not write checkpoint %s", checkpoint_path);
+    }
+    return rays;
+}
+
+// Renders in passes planned by the sampler until every pixel has converged or
+// the budget of samples_per_pixel samples per pixel on average is spent.
+// Pixels accumulate sums as in render_image(); the per-pixel sample counts are
+// left in the sampler. The wavefront integrator runs as path here, which
+// computes the same estimate per sample.
+template <typename World>
+uint64_t render_adaptive(framebuffer& image, const World& world, const camera& cam,
+                         const render_settings& settings, adaptive_sampler& sampler) {
+    uint64_t rays = 0;
+    while (sampler.plan_pass()) {
+        rays += render_tiles(image, settings.threads, settings.tile_size, [&](int i, int j) {
+            color pixel_color = image.at(i, j);
+            int first = sampler.sample_index(i, j);
+            for (int s = first; s < first + sampler.pass_count(i, j); ++s) {
+                color c = trace_sample(world, cam, image, settings, i, j, s);
+                sampler.add(i, j, c);
+                pixel_color += c;
+            }
+            return pixel_color;
+        });
+    }
+    return rays;
+}
+
+#endif
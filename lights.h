@@ -0,0 +1,168 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "rt.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "rectangle.h"
+#include "render.h"
+#include "stats.h"
+
+#include <vector>
+
+// The lights of a scene that next-event estimation samples directly: the
+// emissive rectangles at the top level of the world. Other emitters, such as
+// lights inside instances or emissive spheres and triangles, are still found
+// by the scattered rays alone; supporting them means overriding
+// hittable::pdf_value() and random() and collecting them here.
+class light_list {
+    public:
+        light_list() {}
+        explicit light_list(const hittable_list& world);
+
+        bool empty() const { return lights.empty(); }
+
+        // A light sample as seen from a point: the unit direction to a point
+        // on the chosen light, its distance, the light's emission, and the
+        // density per unit solid angle of choosing that light and direction.
+        struct sample {
+            vec3 direction;
+            double distance;
+            color emission;
+            double pdf;
+        };
+
+        // Chooses a light in proportion to its power and a point uniformly
+        // over its area. Returns false if the light is not visible as a
+        // surface from origin.
+        bool sample_light(const point3& origin, rng& gen, sample& s) const;
+
+        // Density per unit solid angle with which sample_light() picks
+        // direction v from origin, over all lights.
+        double pdf_value(const point3& origin, const vec3& v) const;
+
+    public:
+        struct entry {
+            shared_ptr<hittable> object;
+            color emission;
+            double probability;     // of choosing this light
+        };
+        std::vector<entry> lights;
+};
+
+light_list::light_list(const hittable_list& world) {
+    double total = 0;
+    for (const auto& object : world.objects) {
+        auto rect = std::dynamic_pointer_cast<rectangle>(object);
+        if (!rect || !rect->mat_ptr->is_light)
+            continue;
+        color emission = rect->mat_ptr->emitted();
+        double power = rect->area() * (emission.x() + emission.y() + emission.z());
+        if (power <= 0)
+            continue;
+        entry e;
+        e.object = rect;
+        e.emission = emission;
+        e.probability = power;
+        lights.push_back(e);
+        total += power;
+    }
+    for (entry& e : lights)
+        e.probability /= total;
+}
+
+bool light_list::sample_light(const point3& origin, rng& gen, sample& s) const {
+    if (lights.empty())
+        return false;
+
+    double u = random_double(gen);
+    size_t k = 0;
+    while (k + 1 < lights.size() && u >= lights[k].probability) {
+        u -= lights[k].probability;
+        k++;
+    }
+
+    vec3 v = lights[k].object->random(origin, gen);
+    s.pdf = lights[k].probability * lights[k].object->pdf_value(origin, v);
+    if (s.pdf <= 0)
+        return false;
+    s.distance = v.length();
+    s.direction = v / s.distance;
+    s.emission = lights[k].emission;
+    return true;
+}
+
+double light_list::pdf_value(const point3& origin, const vec3& v) const {
+    double pdf = 0;
+    for (const entry& e : lights)
+        pdf += e.probability * e.object->pdf_value(origin, v);
+    return pdf;
+}
+
+// Weight of a sample drawn with density f when a second strategy would have
+// drawn it with density g (the power heuristic with exponent 2).
+inline double power_heuristic(double f, double g) {
+    return f*f / (f*f + g*g);
+}
+
+// Density of the cosine-weighted direction a Lambertian surface with normal
+// n scatters into; the same for unnormalized directions.
+inline double lambertian_pdf(const vec3& n, const vec3& direction) {
+    double cosine = dot(n, direction) / direction.length();
+    return cosine > 0 ? cosine / pi : 0;
+}
+
+// A shadow ray from a hit to a point sampled on the lights, and the light
+// it brings if nothing lies in between.
+struct shadow_ray {
+    ray r;
+    real t_max;         // 0 if the sample brings no light
+    color contribution;
+};
+
+// Samples one point on the lights from the Lambertian hit rec. The
+// contribution is the light from that point times the BRDF and the cosine,
+// weighted against finding the same light by the cosine-weighted bounce.
+inline void sample_direct(const light_list& lights, const hit_record& rec, const color& albedo, rng& gen,
+                          shadow_ray& shadow) {
+    shadow.t_max = 0;
+    light_list::sample s;
+    if (!lights.sample_light(rec.p, gen, s))
+        return;
+    double cosine = dot(s.direction, rec.normal);
+    if (cosine <= 0)
+        return;
+
+    // Aim at the sampled point from the spawned origin, which single
+    // precision pushes off the surface by more than hit_epsilon.
+    point3 origin = rec.spawn_origin(s.direction);
+    vec3 to_light = rec.p + s.distance * s.direction - origin;
+    double distance = to_light.length();
+    shadow.r = ray(origin, to_light / distance);
+    shadow.t_max = distance - hit_epsilon;
+
+    double weight = power_heuristic(lights.pdf_value(rec.p, s.direction), cosine / pi);
+    shadow.contribution = albedo * s.emission * (cosine / pi * weight / s.pdf);
+}
+
+// Light reaching the Lambertian hit rec from one sampled point on the
+// lights, as sample_direct() weights it, if the shadow ray is unblocked.
+// Counts the shadow ray in rays_traced.
+template <typename World>
+color direct_light(const World& world, const light_list& lights, const hit_record& rec,
+                   const color& albedo, rng& gen) {
+    shadow_ray shadow;
+    sample_direct(lights, rec, albedo, gen, shadow);
+    if (shadow.t_max <= 0)
+        return color(0, 0, 0);
+
+    ++rays_traced;
+    STAT(++thread_stats.shadow_rays);
+    if (world.occluded(shadow.r, hit_epsilon, shadow.t_max))
+        return color(0, 0, 0);
+    return shadow.contribution;
+}
+
+#endif
@@ -3,22 +3,34 @@
 
 #include "rt.h"
 
+#include "arena.h"
+
+#include <vector>
+
 struct hit_record;
 
+// The built-in material types, so that integrators can dispatch on them
+// without a virtual call. Materials defined elsewhere report "other".
+enum class material_kind { lambertian, metal, dielectric, light, other };
+
 
 class material {
     public:
+        material() : kind(material_kind::other) {}
+        virtual ~material() = default;
+
         virtual bool reflect_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const = 0;
         virtual bool refract_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const = 0;
         virtual color emitted() const = 0;
     public:
         bool is_reflect;
         bool is_refract;
         bool is_light;
+        material_kind kind;
 };
 
 
@@ -28,24 +40,25 @@ class lambertian : public material {
             is_reflect = true;
             is_refract = false;
             is_light = false;
+            kind = material_kind::lambertian;
         }
 
         virtual bool reflect_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const override {
-            auto scatter_direction = rec.normal + random_unit_vector();
+            auto scatter_direction = rec.normal + random_unit_vector(gen);
 
             // Catch degenerate scatter direction
             if (scatter_direction.near_zero())
                 scatter_direction = rec.normal;
 
-            scattered = ray(rec.p, scatter_direction);
+            scattered = ray(rec.spawn_origin(scatter_direction), scatter_direction);
             attenuation = albedo;
             return true;
         }
 
         virtual bool refract_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const override {
             return false;
         }
@@ -65,19 +78,21 @@ class metal : public material {
             is_reflect = true;
             is_refract = false;
             is_light = false;
+            kind = material_kind::metal;
         }
 
         virtual bool reflect_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const override {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+            vec3 direction = reflected + fuzz*random_in_unit_sphere(gen);
+            scattered = ray(rec.spawn_origin(direction), direction);
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
         virtual bool refract_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const override {
             return false;
         }
@@ -97,10 +112,11 @@ class dielectric : public material {
             is_reflect = true;
             is_refract = true;
             is_light = false;
+            kind = material_kind::dielectric;
         }
 
         virtual bool reflect_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const override {
             double relative_ir = rec.front_face ? (1.0/ir) : ir;
 
@@ -118,12 +134,12 @@ class dielectric : public material {
             }
 
             direction = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.p, direction);
+            scattered = ray(rec.spawn_origin(direction), direction);
             return true;
         }
 
         virtual bool refract_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const override {
             attenuation = color(0.5, 0.5, 0.5);
             double relative_ir = rec.front_face ? (1.0/ir) : ir;
@@ -142,7 +158,7 @@ class dielectric : public material {
             }
             
             direction = refract(unit_direction, rec.normal, relative_ir);
-            scattered = ray(rec.p, direction);
+            scattered = ray(rec.spawn_origin(direction), direction);
             return true;
         }
 
@@ -169,16 +185,17 @@ class light : public material  {
             is_reflect = false;
             is_refract = false;
             is_light = true;
+            kind = material_kind::light;
         }
 
         virtual bool reflect_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const override {
             return false;
         }
 
         virtual bool refract_ray(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
         ) const override {
             return false;
         }
@@ -190,4 +207,97 @@ class light : public material  {
     public:
         color emit;
 };
+
+
+// Closed-set dispatch: calls the concrete class directly for the built-in
+// kinds, which the compiler can inline, and falls back to the virtual call
+// for anything else.
+inline bool reflect_ray_static(
+    const material* m, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
+) {
+    switch (m->kind) {
+        case material_kind::lambertian:
+            return static_cast<const lambertian*>(m)->lambertian::reflect_ray(r_in, rec, attenuation, scattered, gen);
+        case material_kind::metal:
+            return static_cast<const metal*>(m)->metal::reflect_ray(r_in, rec, attenuation, scattered, gen);
+        case material_kind::dielectric:
+            return static_cast<const dielectric*>(m)->dielectric::reflect_ray(r_in, rec, attenuation, scattered, gen);
+        case material_kind::light:
+            return false;
+        default:
+            return m->reflect_ray(r_in, rec, attenuation, scattered, gen);
+    }
+}
+
+inline bool refract_ray_static(
+    const material* m, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
+) {
+    switch (m->kind) {
+        case material_kind::lambertian:
+        case material_kind::metal:
+        case material_kind::light:
+            return false;
+        case material_kind::dielectric:
+            return static_cast<const dielectric*>(m)->dielectric::refract_ray(r_in, rec, attenuation, scattered, gen);
+        default:
+            return m->refract_ray(r_in, rec, attenuation, scattered, gen);
+    }
+}
+
+inline color emitted_static(const material* m) {
+    switch (m->kind) {
+        case material_kind::light:
+            return static_cast<const light*>(m)->emit;
+        case material_kind::lambertian:
+        case material_kind::metal:
+        case material_kind::dielectric:
+            return color(0,0,0);
+        default:
+            return m->emitted();
+    }
+}
+
+// Chooses between closed-set and virtual dispatch at compile time.
+template <bool closed>
+inline bool dispatch_reflect_ray(
+    const material* m, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
+) {
+    return closed ? reflect_ray_static(m, r_in, rec, attenuation, scattered, gen)
+                  : m->reflect_ray(r_in, rec, attenuation, scattered, gen);
+}
+
+template <bool closed>
+inline bool dispatch_refract_ray(
+    const material* m, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, rng& gen
+) {
+    return closed ? refract_ray_static(m, r_in, rec, attenuation, scattered, gen)
+                  : m->refract_ray(r_in, rec, attenuation, scattered, gen);
+}
+
+template <bool closed>
+inline color dispatch_emitted(const material* m) {
+    return closed ? emitted_static(m) : m->emitted();
+}
+
+
+// Owns every material of a scene. Primitives and hit records refer to them
+// by plain pointer, so the hit path never touches a reference count. The
+// materials are kept side by side in an arena of their own and freed with
+// the table.
+class material_table {
+    public:
+        template <typename T, typename... Args>
+        const material* make(Args&&... args) {
+            materials.push_back(storage.create<T>(std::forward<Args>(args)...));
+            return materials.back();
+        }
+
+        size_t size() const { return materials.size(); }
+
+    public:
+        std::vector<const material*> materials;
+
+    private:
+        scene_arena storage;
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,278 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "rt.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Vertex positions and triangle indices of a Wavefront OBJ file, ready to be
+// handed to triangle_mesh.
+struct obj_data {
+    std::vector<point3> vertices;
+    std::vector<uint32_t> indices;  // three per triangle, zero-based
+};
+
+// Parsing helpers for the loader; each reads one token at p, advances p past
+// it and returns false if there is no number there.
+namespace obj_parse {
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline void skip_spaces(const char*& p, const char* end) {
+    while (p < end && is_space(*p))
+        ++p;
+}
+
+inline void skip_line(const char*& p, const char* end) {
+    while (p < end && *p != '\n')
+        ++p;
+    if (p < end)
+        ++p;
+}
+
+inline bool parse_int(const char*& p, const char* end, long& value) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    if (p == end || *p < '0' || *p > '9')
+        return false;
+    long v = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        v = 10*v + (*p++ - '0');
+    value = negative ? -v : v;
+    return true;
+}
+
+// Decimal and exponent notation. Digits beyond the 18th only shift the
+// exponent, which is well below the precision of a vertex position.
+inline bool parse_double(const char*& p, const char* end, double& value) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+        if (digits < 18) {
+            mantissa = 10*mantissa + (*p - '0');
+            if (mantissa)
+                digits++;
+        } else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+            if (digits < 18) {
+                mantissa = 10*mantissa + (*p - '0');
+                if (mantissa)
+                    digits++;
+                exponent--;
+            }
+        }
+    }
+    if (!any)
+        return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        long e;
+        if (!parse_int(p, end, e))
+            return false;
+        exponent += static_cast<int>(e);
+    }
+
+    double v = static_cast<double>(mantissa);
+    if (exponent < 0)
+        v = exponent >= -22 ? v / powers[-exponent] : v * pow(10.0, exponent);
+    else if (exponent > 0)
+        v = exponent <= 22 ? v * powers[exponent] : v * pow(10.0, exponent);
+    value = negative ? -v : v;
+    return true;
+}
+
+// What one thread produces from its slice of the file.
+struct chunk {
+    const char* begin;
+    const char* end;
+    size_t vertex_offset;           // vertices in the slices before this one
+    size_t vertex_count;
+    std::vector<uint32_t> indices;
+    long error_line;                // first bad line within the slice, or -1
+};
+
+inline size_t count_vertices(const char* p, const char* end) {
+    size_t n = 0;
+    while (p < end) {
+        skip_spaces(p, end);
+        if (end - p > 1 && p[0] == 'v' && is_space(p[1]))
+            n++;
+        skip_line(p, end);
+    }
+    return n;
+}
+
+inline void parse_chunk(chunk& c, point3* vertices, size_t total_vertices) {
+    const char* p = c.begin;
+    const char* end = c.end;
+    size_t local_vertices = 0;
+    long line = 0;
+    c.error_line = -1;
+
+    while (p < end) {
+        ++line;
+        skip_spaces(p, end);
+        if (end - p > 1 && p[0] == 'v' && is_space(p[1])) {
+            p += 2;
+            double xyz[3];
+            for (int k = 0; k < 3; ++k) {
+                skip_spaces(p, end);
+                if (!parse_double(p, end, xyz[k]) && c.error_line < 0)
+                    c.error_line = line;
+            }
+            vertices[c.vertex_offset + local_vertices++] = point3(xyz[0], xyz[1], xyz[2]);
+        } else if (end - p > 1 && p[0] == 'f' && is_space(p[1])) {
+            // Polygons are split into a fan of triangles. Only the position
+            // index of a v/vt/vn triple is used; negative indices count back
+            // from the last vertex read.
+            p += 2;
+            uint32_t first = 0, previous = 0;
+            int corners = 0;
+            for (;;) {
+                skip_spaces(p, end);
+                long index;
+                if (p == end || *p == '\n' || !parse_int(p, end, index))
+                    break;
+                while (p < end && !is_space(*p) && *p != '\n')
+                    ++p;
+
+                long resolved = index > 0 ? index - 1
+                              : static_cast<long>(c.vertex_offset + local_vertices) + index;
+                if (index == 0 || resolved < 0 || static_cast<size_t>(resolved) >= total_vertices) {
+                    if (c.error_line < 0)
+                        c.error_line = line;
+                    resolved = 0;
+                }
+
+                uint32_t v = static_cast<uint32_t>(resolved);
+                if (corners == 0) {
+                    first = v;
+                } else if (corners >= 2) {
+                    c.indices.push_back(first);
+                    c.indices.push_back(previous);
+                    c.indices.push_back(v);
+                }
+                previous = v;
+                corners++;
+            }
+            if (corners < 3 && c.error_line < 0)
+                c.error_line = line;
+        }
+        skip_line(p, end);
+    }
+}
+
+} // namespace obj_parse
+
+// Loads the vertices and faces of an OBJ file; other statements (normals,
+// texture coordinates, groups, materials) are ignored. The file is mapped
+// into memory and cut into one slice per thread at line boundaries. A first
+// pass counts the vertices of every slice, so that the second pass can parse
+// all slices in parallel, writing vertices straight to their final place and
+// resolving face indices without waiting for the slices before.
+bool load_obj(const char* path, obj_data& mesh, int threads) {
+    using namespace obj_parse;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    void* mapping = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (size && mapping == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        return false;
+    }
+    const char* data = static_cast<const char*>(mapping);
+    if (size)
+        madvise(mapping, size, MADV_SEQUENTIAL);
+
+    // Slices of at least 1 MB, each ending just after a newline.
+    threads = std::max(1, std::min<int>(threads, static_cast<int>(size >> 20) + 1));
+    std::vector<chunk> chunks(threads);
+    const char* p = data;
+    for (int k = 0; k < threads; ++k) {
+        const char* stop = k == threads-1 ? data + size : std::max(p, data + size * (k+1) / threads);
+        while (stop < data + size && stop[-1] != '\n')
+            ++stop;
+        chunks[k].begin = p;
+        chunks[k].end = stop;
+        p = stop;
+    }
+
+    auto run = [&](std::function<void(chunk&)> work) {
+        std::vector<std::thread> pool;
+        for (int k = 1; k < threads; ++k)
+            pool.push_back(std::thread(work, std::ref(chunks[k])));
+        work(chunks[0]);
+        for (auto& th : pool)
+            th.join();
+    };
+
+    run([](chunk& c) { c.vertex_count = count_vertices(c.begin, c.end); });
+    size_t total_vertices = 0;
+    for (chunk& c : chunks) {
+        c.vertex_offset = total_vertices;
+        total_vertices += c.vertex_count;
+    }
+
+    mesh.vertices.resize(total_vertices);
+    point3* vertices = mesh.vertices.data();
+    run([&](chunk& c) { parse_chunk(c, vertices, total_vertices); });
+
+    size_t total_indices = 0;
+    bool ok = true;
+    for (chunk& c : chunks) {
+        total_indices += c.indices.size();
+        if (c.error_line >= 0 && ok) {
+            // Report the line number within the whole file.
+            long line = c.error_line;
+            for (const char* q = data; q < c.begin; ++q)
+                line += *q == '\n';
+            fprintf(stderr, "%s:%ld: malformed vertex or face\n", path, line);
+            ok = false;
+        }
+    }
+
+    mesh.indices.clear();
+    mesh.indices.reserve(total_indices);
+    for (chunk& c : chunks)
+        mesh.indices.insert(mesh.indices.end(), c.indices.begin(), c.indices.end());
+
+    if (size)
+        munmap(mapping, size);
+    return ok;
+}
+
+#endif
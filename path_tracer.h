@@ -0,0 +1,299 @@
+#ifndef PATH_TRACER_H
+#define PATH_TRACER_H
+
+#include "rt.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "render.h"
+#include "stats.h"
+
+#include <vector>
+
+// Paths are ended by Russian roulette from this bounce on.
+const int roulette_depth = 3;
+
+static_assert(static_cast<int>(material_kind::other) + 1 == stat_material_kinds,
+              "stats count secondary rays per material kind");
+
+// One bounce of the single-path estimator at a hit: adds the emission, then
+// follows one of the reflected and refracted rays, chosen with probability
+// proportional to its attenuation and weighted by the inverse of that
+// probability. Returns false once the path has ended; otherwise r holds the
+// next ray.
+// Given lights, a Lambertian hit also samples them directly (next-event
+// estimation) if the path could still reach them with another bounce.
+// Emission found by a ray scattered off a Lambertian surface is then
+// weighted against that light sampling by multiple importance sampling;
+// bsdf_pdf carries the density of that ray to the next hit, and is 0 for
+// camera rays and specular bounces, whose emission keeps its full weight.
+// Given deferred, the shadow ray of the light sample is left there for the
+// caller to trace, its contribution still to be multiplied by the throughput
+// the path had on entry; its t_max is 0 if there is none.
+template <bool closed, typename World>
+inline bool scatter_path(
+    const World& world, const light_list* lights, ray& r, const hit_record& rec, int bounce, int max_depth,
+    color& throughput, color& radiance, double& bsdf_pdf, rng& gen, shadow_ray* deferred = nullptr
+) {
+    const material* mat = rec.mat_ptr;
+    if (mat->is_light) {
+        color emission = dispatch_emitted<closed>(mat);
+        if (bsdf_pdf > 0)
+            emission *= power_heuristic(bsdf_pdf, lights->pdf_value(r.origin(), r.direction()));
+        radiance += throughput * emission;
+    }
+
+    const bool diffuse = lights && mat->kind == material_kind::lambertian;
+    if (deferred)
+        deferred->t_max = 0;
+    if (diffuse && bounce + 1 < max_depth) {
+        const color& albedo = static_cast<const lambertian*>(mat)->albedo;
+        if (deferred)
+            sample_direct(*lights, rec, albedo, gen, *deferred);
+        else
+            radiance += throughput * direct_light(world, *lights, rec, albedo, gen);
+    }
+
+    ray reflected, refracted;
+    color reflect_attenuation, refract_attenuation;
+    double reflect_weight = 0, refract_weight = 0;
+    if (mat->is_reflect && dispatch_reflect_ray<closed>(mat, r, rec, reflect_attenuation, reflected, gen))
+        reflect_weight = reflect_attenuation.x() + reflect_attenuation.y() + reflect_attenuation.z();
+    if (mat->is_refract && dispatch_refract_ray<closed>(mat, r, rec, refract_attenuation, refracted, gen))
+        refract_weight = refract_attenuation.x() + refract_attenuation.y() + refract_attenuation.z();
+
+    double total_weight = reflect_weight + refract_weight;
+    if (total_weight <= 0) {
+        STAT(++thread_stats.ended_absorbed);
+        return false;
+    }
+    if (random_double(gen) * total_weight < reflect_weight) {
+        throughput = throughput * reflect_attenuation * (total_weight / reflect_weight);
+        r = reflected;
+    } else {
+        throughput = throughput * refract_attenuation * (total_weight / refract_weight);
+        r = refracted;
+    }
+    bsdf_pdf = diffuse ? lambertian_pdf(rec.normal, r.direction()) : 0;
+
+    if (bounce + 1 >= roulette_depth) {
+        double survive = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 1.0);
+        if (random_double(gen) >= survive) {
+            STAT(++thread_stats.ended_roulette);
+            return false;
+        }
+        throughput /= survive;
+    }
+    STAT(++thread_stats.secondary_rays[static_cast<int>(mat->kind)]);
+    return true;
+}
+
+// Breadth-first version of the single-path integrator. The paths of a tile
+// are kept in per-field queues and advanced one bounce at a time in stages:
+// intersect every live path, bin the hits by material kind, shade each bin,
+// and compact the survivors into the next queue. With lights, the shadow rays
+// of a bounce are queued while shading and then traced together as any-hit
+// queries in packets. Each path keeps its own rng, so the image is identical
+// to tracing the paths one by one.
+template <typename World>
+class wavefront_tracer {
+    public:
+        wavefront_tracer(
+            const World& w, const camera& c, color (*bg)(const ray&), int depth, const light_list* l = nullptr,
+            int batch = 1 << 16
+        ) : world(w), cam(c), background(bg), max_depth(depth), lights(l), batch_size(batch) {}
+
+        // Adds samples [first_sample, first_sample + sample_count) of every
+        // pixel of t to the sums in fb.
+        void render_tile(framebuffer& fb, const tile& t, int first_sample, int sample_count, uint64_t seed,
+                         sample_sequence sequence);
+
+    private:
+        void generate(const framebuffer& fb, const tile& t, int first_sample, int samples, uint64_t seed,
+                      sample_sequence sequence);
+        void intersect(int bounce);
+        void sort_by_material();
+        void shade(int bounce);
+        void trace_shadows();
+
+    private:
+        const World& world;
+        const camera& cam;
+        color (*background)(const ray&);
+        int max_depth;
+        const light_list* lights;   // sampled at diffuse hits if set; see scatter_path()
+        int batch_size;
+
+        // Per-path state, indexed by path.
+        std::vector<point3> origin;
+        std::vector<vec3> direction;
+        std::vector<color> throughput;
+        std::vector<color> radiance;
+        std::vector<double> bsdf_pdf;
+        std::vector<rng> gens;
+
+        // Live paths, then the hits of this bounce (path index and record).
+        std::vector<int> active;
+        std::vector<int> hit_paths;
+        std::vector<hit_record> hits;
+        std::vector<int> sorted;
+
+        // Shadow rays queued by shade(), with the light each brings to its
+        // path if unblocked and the path's throughput at that hit.
+        std::vector<int> shadow_paths;
+        std::vector<ray> shadow_rays;
+        std::vector<real> shadow_t_max;
+        std::vector<color> shadow_light;
+        std::vector<color> shadow_throughput;
+        std::vector<char> blocked;
+};
+
+template <typename World>
+void wavefront_tracer<World>::render_tile(framebuffer& fb, const tile& t, int first_sample, int sample_count, uint64_t seed,
+                                          sample_sequence sequence) {
+    int pixels = (t.x1 - t.x0) * (t.y1 - t.y0);
+    int samples = std::max(1, std::min(sample_count, batch_size / pixels));
+    int end = first_sample + sample_count;
+
+    for (int first = first_sample; first < end; first += samples) {
+        int count = std::min(samples, end - first);
+        generate(fb, t, first, count, seed, sequence);
+        for (int bounce = 0; bounce < max_depth && !active.empty(); ++bounce) {
+            intersect(bounce);
+            sort_by_material();
+            shade(bounce);
+            trace_shadows();
+        }
+        STAT(thread_stats.ended_depth += active.size());
+        STAT(for (size_t k = 0; k < active.size(); ++k) stat_path_length(max_depth));
+
+        // Accumulate in sample order, as the per-pixel integrators do.
+        int path = 0;
+        for (int j = t.y0; j < t.y1; ++j)
+            for (int i = t.x0; i < t.x1; ++i)
+                for (int s = 0; s < count; ++s)
+                    fb.at(i, j) += radiance[path++];
+    }
+}
+
+template <typename World>
+void wavefront_tracer<World>::generate(
+    const framebuffer& fb, const tile& t, int first_sample, int samples, uint64_t seed, sample_sequence sequence
+) {
+    size_t n = static_cast<size_t>((t.x1 - t.x0) * (t.y1 - t.y0)) * samples;
+    origin.resize(n);
+    direction.resize(n);
+    throughput.assign(n, color(1, 1, 1));
+    radiance.assign(n, color(0, 0, 0));
+    bsdf_pdf.assign(n, 0);
+    gens.resize(n);
+    active.resize(n);
+
+    int path = 0;
+    for (int j = t.y0; j < t.y1; ++j) {
+        for (int i = t.x0; i < t.x1; ++i) {
+            for (int s = first_sample; s < first_sample + samples; ++s) {
+                rng& gen = gens[path];
+                gen = rng(seed, j*fb.width + i, s, sequence);
+                auto u = (i + random_double(gen)) / (fb.width-1);
+                auto v = (j + random_double(gen)) / (fb.height-1);
+                ray r = cam.get_ray(u, v, gen);
+                origin[path] = r.origin();
+                direction[path] = r.direction();
+                active[path] = path;
+                path++;
+                STAT(++thread_stats.camera_rays);
+            }
+        }
+    }
+}
+
+template <typename World>
+void wavefront_tracer<World>::intersect(int bounce) {
+    hit_paths.clear();
+    hits.resize(active.size());
+    size_t count = 0;
+    for (int path : active) {
+        ray r(origin[path], direction[path]);
+        ++rays_traced;
+        if (world.hit(r, hit_epsilon, infinity, hits[count])) {
+            hit_paths.push_back(path);
+            count++;
+        } else {
+            radiance[path] += throughput[path] * background(r);
+            STAT(++thread_stats.ended_escaped);
+            STAT(stat_path_length(bounce + 1));
+        }
+    }
+    hits.resize(count);
+}
+
+template <typename World>
+void wavefront_tracer<World>::sort_by_material() {
+    // Counting sort on the material kind; stable, so paths stay in tile order
+    // within a bin.
+    const int kinds = static_cast<int>(material_kind::other) + 1;
+    int start[kinds + 1] = {0};
+    for (const hit_record& rec : hits)
+        start[static_cast<int>(rec.mat_ptr->kind) + 1]++;
+    for (int k = 0; k < kinds; ++k)
+        start[k + 1] += start[k];
+
+    sorted.resize(hits.size());
+    for (size_t h = 0; h < hits.size(); ++h)
+        sorted[start[static_cast<int>(hits[h].mat_ptr->kind)]++] = static_cast<int>(h);
+}
+
+template <typename World>
+void wavefront_tracer<World>::shade(int bounce) {
+    active.clear();
+    shadow_paths.clear();
+    shadow_rays.clear();
+    shadow_t_max.clear();
+    shadow_light.clear();
+    shadow_throughput.clear();
+    for (int h : sorted) {
+        int path = hit_paths[h];
+        ray r(origin[path], direction[path]);
+        color entry_throughput = throughput[path];
+        shadow_ray shadow;
+        bool alive = scatter_path<World::closed_set>(world, lights, r, hits[h], bounce, max_depth,
+                                                     throughput[path], radiance[path], bsdf_pdf[path],
+                                                     gens[path], lights ? &shadow : nullptr);
+        if (lights && shadow.t_max > 0) {
+            shadow_paths.push_back(path);
+            shadow_rays.push_back(shadow.r);
+            shadow_t_max.push_back(shadow.t_max);
+            shadow_light.push_back(shadow.contribution);
+            shadow_throughput.push_back(entry_throughput);
+        }
+        if (alive) {
+            origin[path] = r.origin();
+            direction[path] = r.direction();
+            active.push_back(path);
+        } else {
+            STAT(stat_path_length(bounce + 1));
+        }
+    }
+}
+
+// Nothing else adds to a path's radiance between its shading and its next
+// intersection, so the sums come out in the same order, and in the same
+// form, as with direct_light().
+template <typename World>
+void wavefront_tracer<World>::trace_shadows() {
+    size_t n = shadow_rays.size();
+    if (n == 0)
+        return;
+    blocked.resize(n);
+    occluded_batch(world, shadow_rays.data(), shadow_t_max.data(), n, hit_epsilon, blocked.data());
+    rays_traced += n;
+    STAT(thread_stats.shadow_rays += n);
+    for (size_t k = 0; k < n; ++k)
+        if (!blocked[k])
+            radiance[shadow_paths[k]] += shadow_throughput[k] * shadow_light[k];
+}
+
+#endif
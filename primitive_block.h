@@ -0,0 +1,243 @@
+#ifndef PRIMITIVE_BLOCK_H
+#define PRIMITIVE_BLOCK_H
+
+#include "rt.h"
+
+#include "hittable.h"
+#include "simd.h"
+#include "stats.h"
+#include "sphere.h"
+#include "triangle.h"
+
+// Selects the leaf kernels at runtime: when set, bvh leaves are repacked into
+// the SIMD blocks below; when cleared, leaves keep the scalar primitives,
+// which serve as the reference implementation.
+bool simd_leaves = true;
+
+// Up to four triangles in structure-of-arrays layout, intersected with one
+// ray at once by a Moller-Trumbore kernel.
+class triangle4 : public hittable {
+    public:
+        triangle4() : count(0) {
+            for (int a = 0; a < 3; a++)
+                for (int i = 0; i < 4; i++)
+                    v0[a][i] = e1[a][i] = e2[a][i] = normal[a][i] = 0;
+            for (int i = 0; i < 4; i++)
+                det_limit[i] = 0;
+        }
+
+        void add(const triangle& tri);
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
+
+        // Mask of the primitives r meets in [t_min, t_max], with the
+        // distances in t.
+        int intersect(const ray& r, real t_min, real t_max, real4& t) const;
+
+    public:
+        real v0[3][4];        // first vertex
+        real e1[3][4];        // vertex[1] - vertex[0]
+        real e2[3][4];        // vertex[2] - vertex[0]
+        real normal[3][4];    // same (unnormalized) normal as triangle::hit
+        real det_limit[4];    // (det_epsilon |e1| |e2|)^2
+        const material* mat_ptr[4];
+        int count;
+        aabb box;
+};
+
+void triangle4::add(const triangle& tri) {
+    vec3 a = tri.vertex[1] - tri.vertex[0];
+    vec3 b = tri.vertex[2] - tri.vertex[0];
+    vec3 n = cross(b, a);
+    for (int k = 0; k < 3; k++) {
+        v0[k][count] = tri.vertex[0][k];
+        e1[k][count] = a[k];
+        e2[k][count] = b[k];
+        normal[k][count] = n[k];
+    }
+    det_limit[count] = det_epsilon*det_epsilon * a.length_squared() * b.length_squared();
+    mat_ptr[count] = tri.mat_ptr;
+
+    aabb tri_box;
+    tri.bounding_box(tri_box);
+    box.expand(tri_box);
+    count++;
+}
+
+int triangle4::intersect(const ray& r, real t_min, real t_max, real4& t) const {
+    STAT(stat_tests(stat_primitive::triangle, count));
+    const real4 zero(0.0), one(1.0);
+    const real4 dx(r.dir[0]), dy(r.dir[1]), dz(r.dir[2]);
+    const real4 e1x = real4::load(e1[0]), e1y = real4::load(e1[1]), e1z = real4::load(e1[2]);
+    const real4 e2x = real4::load(e2[0]), e2y = real4::load(e2[1]), e2z = real4::load(e2[2]);
+
+    // pvec = dir x e2, det = e1 . pvec
+    real4 px = dy*e2z - dz*e2y;
+    real4 py = dz*e2x - dx*e2z;
+    real4 pz = dx*e2y - dy*e2x;
+    real4 det = e1x*px + e1y*py + e1z*pz;
+    real4 inv_det = one / det;
+
+    real4 tx = real4(r.orig[0]) - real4::load(v0[0]);
+    real4 ty = real4(r.orig[1]) - real4::load(v0[1]);
+    real4 tz = real4(r.orig[2]) - real4::load(v0[2]);
+    real4 u = (tx*px + ty*py + tz*pz) * inv_det;
+
+    // qvec = tvec x e1
+    real4 qx = ty*e1z - tz*e1y;
+    real4 qy = tz*e1x - tx*e1z;
+    real4 qz = tx*e1y - ty*e1x;
+    real4 v = (dx*qx + dy*qy + dz*qz) * inv_det;
+    t = (e2x*qx + e2y*qy + e2z*qz) * inv_det;
+
+    // Same determinant threshold and inclusive bounds as triangle::hit.
+    const real4 det_bound = real4::load(det_limit) * real4(r.dir.length_squared());
+    mask4 m = (det*det > det_bound) & (u >= zero) & (v >= zero) & (u + v <= one)
+            & (t >= real4(t_min)) & (t <= real4(t_max));
+    return m.bits() & ((1 << count) - 1);
+}
+
+bool triangle4::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    real4 t;
+    int bits = intersect(r, t_min, t_max, t);
+    if (!bits)
+        return false;
+
+    real ts[4];
+    t.store(ts);
+    int best = -1;
+    for (int i = 0; i < 4; i++) {
+        if ((bits >> i) & 1 && (best < 0 || ts[i] < ts[best]))
+            best = i;
+    }
+
+    vec3 outward_normal(normal[0][best], normal[1][best], normal[2][best]);
+    if (dot(outward_normal, r.direction()) > 0)
+        outward_normal *= -1;
+
+    rec.t = ts[best];
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr[best];
+
+    return true;
+}
+
+bool triangle4::occluded(const ray& r, real t_min, real t_max) const {
+    real4 t;
+    return intersect(r, t_min, t_max, t) != 0;
+}
+
+bool triangle4::bounding_box(aabb& output_box) const {
+    output_box = box;
+    return count > 0;
+}
+
+// Up to four spheres in structure-of-arrays layout.
+class sphere4 : public hittable {
+    public:
+        sphere4() : count(0) {
+            for (int a = 0; a < 3; a++)
+                for (int i = 0; i < 4; i++)
+                    center[a][i] = 0;
+            for (int i = 0; i < 4; i++)
+                radius[i] = radius_squared[i] = 0;
+        }
+
+        void add(const sphere& s);
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
+
+        // Mask of the primitives r meets in [t_min, t_max], with the
+        // distances in t.
+        int intersect(const ray& r, real t_min, real t_max, real4& t) const;
+
+    public:
+        real center[3][4];
+        real radius[4];
+        real radius_squared[4];
+        const material* mat_ptr[4];
+        int count;
+        aabb box;
+};
+
+void sphere4::add(const sphere& s) {
+    for (int k = 0; k < 3; k++)
+        center[k][count] = s.center[k];
+    radius[count] = s.radius;
+    radius_squared[count] = s.radius * s.radius;
+    mat_ptr[count] = s.mat_ptr;
+
+    aabb sphere_box;
+    s.bounding_box(sphere_box);
+    box.expand(sphere_box);
+    count++;
+}
+
+int sphere4::intersect(const ray& r, real t_min, real t_max, real4& t) const {
+    STAT(stat_tests(stat_primitive::sphere, count));
+    const real4 zero(0.0);
+    const real4 dx(r.dir[0]), dy(r.dir[1]), dz(r.dir[2]);
+    const real a = r.dir.length_squared();
+    const real4 inv_a(1.0 / a);
+
+    real4 ocx = real4(r.orig[0]) - real4::load(center[0]);
+    real4 ocy = real4(r.orig[1]) - real4::load(center[1]);
+    real4 ocz = real4(r.orig[2]) - real4::load(center[2]);
+    real4 half_b = ocx*dx + ocy*dy + ocz*dz;
+    real4 c = ocx*ocx + ocy*ocy + ocz*ocz - real4::load(radius_squared);
+
+    real4 discriminant = half_b*half_b - real4(a)*c;
+    mask4 valid = discriminant >= zero;
+    real4 sqrtd = sqrt(select(valid, discriminant, zero));
+
+    // Take the nearest root in range, as sphere::hit does.
+    real4 near_root = (zero - half_b - sqrtd) * inv_a;
+    real4 far_root = (zero - half_b + sqrtd) * inv_a;
+    mask4 near_ok = (near_root >= real4(t_min)) & (near_root <= real4(t_max));
+    mask4 far_ok = (far_root >= real4(t_min)) & (far_root <= real4(t_max));
+    t = select(near_ok, near_root, far_root);
+    return (valid & (near_ok | far_ok)).bits() & ((1 << count) - 1);
+}
+
+bool sphere4::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    real4 t;
+    int bits = intersect(r, t_min, t_max, t);
+    if (!bits)
+        return false;
+
+    real ts[4];
+    t.store(ts);
+    int best = -1;
+    for (int i = 0; i < 4; i++) {
+        if ((bits >> i) & 1 && (best < 0 || ts[i] < ts[best]))
+            best = i;
+    }
+
+    rec.t = ts[best];
+    rec.p = r.at(rec.t);
+    point3 cen(center[0][best], center[1][best], center[2][best]);
+    vec3 outward_normal = (rec.p - cen) / radius[best];
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr[best];
+
+    return true;
+}
+
+bool sphere4::occluded(const ray& r, real t_min, real t_max) const {
+    real4 t;
+    return intersect(r, t_min, t_max, t) != 0;
+}
+
+bool sphere4::bounding_box(aabb& output_box) const {
+    output_box = box;
+    return count > 0;
+}
+
+#endif
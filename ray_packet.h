@@ -0,0 +1,148 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "rt.h"
+
+#include "aabb.h"
+#include "simd.h"
+
+#include <algorithm>
+
+// Largest packet; packets hold 4, 8 or 16 rays.
+const int max_packet_size = 16;
+
+// A bundle of rays traced through a hierarchy together, such as the camera
+// rays of a block of neighbouring pixels. Origins, reciprocal directions and
+// the closest hit so far are kept in structure-of-arrays layout so that
+// real4 tests four rays against a box at once. Call prepare() once all rays
+// are added.
+class ray_packet {
+    public:
+        ray_packet() : count(0) {}
+
+        void clear() { count = 0; }
+
+        void add(const ray& r) {
+            int k = count++;
+            rays[k] = r;
+            for (int a = 0; a < 3; a++) {
+                origin[a][k] = r.orig[a];
+                inv_dir[a][k] = static_cast<real>(1.0 / r.dir[a]);
+            }
+            t_max[k] = infinity;
+        }
+
+        // Pads the last group of four with copies of the last ray, and works
+        // out whether the packet can be bounded by interval arithmetic.
+        void prepare();
+
+        int lanes() const { return (count + 3) & ~3; }
+        int all() const { return (1 << count) - 1; }
+
+        // Mask of the rays in active whose slab test against box succeeds
+        // between t_min and their own closest hit, as aabb::hit decides it.
+        int hit_box(const aabb& box, real t_min, int active) const;
+
+        // False if no ray of the packet can meet box between t_min and
+        // t_far. Only meaningful for coherent packets.
+        bool frustum_hits(const aabb& box, real t_min, real t_far) const;
+
+        // Largest closest hit over the rays in active.
+        real farthest(int active) const {
+            real f = -infinity;
+            for (int k = 0; k < count; k++)
+                if ((active >> k) & 1)
+                    f = std::max(f, t_max[k]);
+            return f;
+        }
+
+    public:
+        ray rays[max_packet_size];
+        real origin[3][max_packet_size];
+        real inv_dir[3][max_packet_size];
+        real t_max[max_packet_size];     // closest hit so far, infinity if none
+        int count;
+
+        // Set by prepare(): whether every ray points the same way on each
+        // axis, the sign on each axis, and the range of origins and of
+        // reciprocal directions over the packet.
+        bool coherent;
+        bool dir_is_neg[3];
+        real origin_lo[3], origin_hi[3];
+        real inv_lo[3], inv_hi[3];
+};
+
+void ray_packet::prepare() {
+    for (int k = count; k < lanes(); k++) {
+        for (int a = 0; a < 3; a++) {
+            origin[a][k] = origin[a][count-1];
+            inv_dir[a][k] = inv_dir[a][count-1];
+        }
+        t_max[k] = t_max[count-1];
+    }
+
+    coherent = count > 1;
+    for (int a = 0; a < 3; a++) {
+        dir_is_neg[a] = rays[0].dir[a] < 0;
+        origin_lo[a] = origin_hi[a] = origin[a][0];
+        inv_lo[a] = inv_hi[a] = inv_dir[a][0];
+        for (int k = 0; k < count; k++) {
+            // An axis the direction does not move along has an infinite
+            // reciprocal, which the interval bounds cannot use.
+            if (rays[k].dir[a] == 0 || (rays[k].dir[a] < 0) != dir_is_neg[a])
+                coherent = false;
+            origin_lo[a] = std::min(origin_lo[a], origin[a][k]);
+            origin_hi[a] = std::max(origin_hi[a], origin[a][k]);
+            inv_lo[a] = std::min(inv_lo[a], inv_dir[a][k]);
+            inv_hi[a] = std::max(inv_hi[a], inv_dir[a][k]);
+        }
+    }
+}
+
+int ray_packet::hit_box(const aabb& box, real t_min, int active) const {
+    const real4 lower_t(t_min), zero(0.0);
+    int hits = 0;
+    for (int g = 0; g < lanes(); g += 4) {
+        if (!((active >> g) & 0xf))
+            continue;
+        real4 enter = lower_t;
+        real4 leave = real4::load(t_max + g);
+        for (int a = 0; a < 3; a++) {
+            real4 o = real4::load(origin[a] + g);
+            real4 inv = real4::load(inv_dir[a] + g);
+            real4 t0 = (real4(box.minimum[a]) - o) * inv;
+            real4 t1 = (real4(box.maximum[a]) - o) * inv;
+            mask4 neg = inv < zero;
+            real4 near_t = select(neg, t1, t0);
+            real4 far_t = select(neg, t0, t1);
+            // A NaN bound (origin on a slab plane of a flat box) leaves the
+            // interval alone, as in aabb::hit.
+            enter = select(near_t > enter, near_t, enter);
+            leave = select(far_t < leave, far_t, leave);
+        }
+        hits |= (leave >= enter).bits() << g;
+    }
+    return hits & active;
+}
+
+bool ray_packet::frustum_hits(const aabb& box, real t_min, real t_far) const {
+    real enter = t_min, leave = t_far;
+    for (int a = 0; a < 3; a++) {
+        real first = dir_is_neg[a] ? box.maximum[a] : box.minimum[a];
+        real second = dir_is_neg[a] ? box.minimum[a] : box.maximum[a];
+
+        // (plane - origin) * inv_dir over the ranges of origin and inv_dir
+        // is bounded by its values at the corners.
+        real e0 = (first - origin_hi[a]) * inv_lo[a], e1 = (first - origin_hi[a]) * inv_hi[a];
+        real e2 = (first - origin_lo[a]) * inv_lo[a], e3 = (first - origin_lo[a]) * inv_hi[a];
+        real x0 = (second - origin_hi[a]) * inv_lo[a], x1 = (second - origin_hi[a]) * inv_hi[a];
+        real x2 = (second - origin_lo[a]) * inv_lo[a], x3 = (second - origin_lo[a]) * inv_hi[a];
+        enter = std::max(enter, std::min(std::min(e0, e1), std::min(e2, e3)));
+        leave = std::min(leave, std::max(std::max(x0, x1), std::max(x2, x3)));
+        if (leave < enter)
+            return false;
+    }
+    return true;
+}
+
+#endif
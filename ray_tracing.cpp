@@ -1,217 +1,622 @@
 #include "rt.h"
 
+#include "animation.h"
 #include "color.h"
 #include "hittable_list.h"
-#include "sphere.h"
 #include "camera.h"
 #include "material.h"
-#include "rectangle.h"
-#include "triangle.h"
+#include "render.h"
+#include "bvh.h"
+#include "closed_scene.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "integrator.h"
+#include "lights.h"
+#include "builtin_scenes.h"
+#include "image_writer.h"
+#include "scene_file.h"
+#include "stats.h"
+#include <chrono>
+#include <fstream>
+#include <iterator>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#define NONE 0
-// 0: random scene, 1: cornell box, 2: triangle scene
+// 0: random scene, 1: cornell box, 2: triangle scene, 3: instanced scene, 4: mesh scene
 #define world_type 2
 
-color ray_color(const ray& r, const hittable& world, int depth, color prev_attenuation) {
-    hit_record rec;
-
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
-        return color(0,0,0);
-    if ((prev_attenuation.x() <= 0.01) &&
-        (prev_attenuation.y() <= 0.01) &&
-        (prev_attenuation.z() <= 0.01) )
-        return color(0,0,0);
-
-    if (world.hit(r, 0.001, infinity, rec)) {
-        color tmp_color(0, 0, 0);
-        ray scattered;
-        color attenuation;
-        if (rec.mat_ptr->is_reflect && rec.mat_ptr->reflect_ray(r, rec, attenuation, scattered))
-            tmp_color += attenuation * ray_color(scattered, world, depth-1, attenuation * prev_attenuation);
-        if (rec.mat_ptr->is_refract && rec.mat_ptr->refract_ray(r, rec, attenuation, scattered))
-            tmp_color += attenuation * ray_color(scattered, world, depth-1, attenuation * prev_attenuation);
-        if (rec.mat_ptr->is_light)
-            tmp_color += rec.mat_ptr->emitted();
-        
-        return tmp_color;
-    }
-
-    vec3 unit_direction = unit_vector(r.direction());
-    auto t = 0.5*(unit_direction.y() + 1.0);
-    if(world_type==1)
-        return color(0,0,0);
-    return (1.0-t)*color(1.0, 1.0, 1.0) + t*color(0.5, 0.7, 1.0);
+// Compares the SIMD leaf blocks against the scalar primitives on camera rays
+// and on random rays leaving their first hit. Returns the number of rays on
+// which the two disagree.
+int check_leaf_kernels(const hittable_list& world, const camera& cam, int count, uint64_t seed) {
+    bvh reference(world, false);
+    bvh blocks(world, true);
+    rng gen(seed, 0, 1);
+
+    int rays = 0, mismatches = 0;
+    double max_error = 0;
+    // The two kernels round differently; allow for it in single precision.
+    const double tolerance = sizeof(real) < sizeof(double) ? 1e-4 : 1e-8;
+    auto compare = [&](const ray& r, hit_record& rec) {
+        hit_record other;
+        bool hit_ref = reference.hit(r, hit_epsilon, infinity, rec);
+        bool hit_simd = blocks.hit(r, hit_epsilon, infinity, other);
+        rays++;
+        if (hit_ref != hit_simd) {
+            mismatches++;
+        } else if (hit_ref) {
+            double error = fabs(rec.t - other.t) / fmax(1.0, rec.t);
+            max_error = fmax(max_error, error);
+            if (error > tolerance)
+                mismatches++;
+        }
+        return hit_ref;
+    };
+
+    for (int k = 0; k < count; k++) {
+        hit_record rec;
+        ray r = cam.get_ray(random_double(gen), random_double(gen), gen);
+        if (compare(r, rec))
+            compare(ray(rec.p, random_unit_vector(gen)), rec);
+    }
+
+    fprintf(stderr, "Leaf kernel check (%s): %d rays, %d mismatches, max relative t error %g\n",
+            SIMD_ISA, rays, mismatches, max_error);
+    return mismatches;
+}
+
+// Traces the same camera paths through a scene on the calling thread and
+// returns the time taken in seconds, for comparing scene representations.
+template <typename World>
+double time_paths(const World& world, const camera& cam, int count, int max_depth, uint64_t seed,
+                  uint64_t& rays, color& total) {
+    rays_traced = 0;
+    total = color(0, 0, 0);
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < count; k++) {
+        rng gen(seed, k, 0);
+        ray r = cam.get_ray(random_double(gen), random_double(gen), gen);
+        total += ray_color(r, world, max_depth, color(1.0, 1.0, 1.0), gen);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    rays = rays_traced;
+    return elapsed.count();
+}
+
+// Benchmarks the virtual interface (bvh of hittables, virtual materials)
+// against the closed-set representation on identical paths.
+void bench_dispatch(const hittable_list& world, const camera& cam, int count, int max_depth, uint64_t seed) {
+    bvh open_world(world);
+    closed_scene closed_world(world);
+
+    uint64_t rays;
+    color total;
+    const hittable& open_ref = open_world;
+    double t = time_paths(open_ref, cam, count, max_depth, seed, rays, total);
+    fprintf(stderr, "virtual: %d paths, %llu rays in %.3f s (%.2f Mrays/s, %.1f ns/ray), mean radiance %g\n",
+            count, static_cast<unsigned long long>(rays), t, rays / t * 1e-6, t * 1e9 / rays,
+            (total.x() + total.y() + total.z()) / (3.0 * count));
+    t = time_paths(closed_world, cam, count, max_depth, seed, rays, total);
+    fprintf(stderr, "closed:  %d paths, %llu rays in %.3f s (%.2f Mrays/s, %.1f ns/ray), mean radiance %g\n",
+            count, static_cast<unsigned long long>(rays), t, rays / t * 1e-6, t * 1e9 / rays,
+            (total.x() + total.y() + total.z()) / (3.0 * count));
 }
 
-hittable_list random_scene() {
-    hittable_list world;
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+// Renders the frames of an animated scene one after another, keeping the
+// scene in memory, and writes each to the file output_pattern names for it,
+// or all of them in turn to stdout. Between frames the animated objects are
+// moved and accel, if any, is refit to their new bounds; it is built again
+// instead once refitting has raised its SAH cost to more than rebuild_ratio
+// times the cost it had when last built. The time spent between renders is
+// reported apart from the rendering time. Each frame draws its own samples,
+// from the seed plus the frame number.
+int render_animation(const scene_description& description, const hittable& scene, bvh* accel,
+                     render_settings settings, const vec3& vup, image_format format,
+                     const char* output_pattern, double rebuild_ratio) {
+    typedef std::chrono::steady_clock clock;
+    const scene_animation& animation = description.animation;
+    int image_width = description.image_width;
+    int image_height = std::max(1, static_cast<int>(image_width / description.aspect_ratio));
+    framebuffer image(image_width, image_height);
+    const uint64_t seed = settings.seed;
+    double built_cost = accel ? bvh_sah_cost(accel->nodes) : 0;
+    double update_total = 0, render_total = 0, write_total = 0;
+    int refits = 0, rebuilds = 0;
+    uint64_t rays_total = 0;
+
+    for (int frame = animation.first_frame; frame <= animation.last_frame; ++frame) {
+        // The objects are in place for the first frame already, and the
+        // hierarchy was built for it.
+        auto update_start = clock::now();
+        const char* update = "set up";
+        if (frame != animation.first_frame) {
+            animation.set_frame(frame);
+            update = "moved";
+            if (accel) {
+                accel->refit();
+                update = "refit";
+                if (bvh_sah_cost(accel->nodes) > rebuild_ratio * built_cost) {
+                    *accel = bvh(description.world);
+                    built_cost = bvh_sah_cost(accel->nodes);
+                    update = "rebuilt";
+                    ++rebuilds;
                 } else {
-                    // glass
-                    auto albedo = color::random(0.9, 1);
-                    sphere_material = make_shared<dielectric>(1.5, albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    ++refits;
                 }
             }
         }
+        point3 lookfrom = description.lookfrom, lookat = description.lookat;
+        animation.camera_at(frame, lookfrom, lookat);
+        camera cam(lookfrom, lookat, vup, description.vfov, description.aspect_ratio,
+                   description.aperture, description.focus_dist);
+        std::fill(image.pixels.begin(), image.pixels.end(), color(0, 0, 0));
+        std::chrono::duration<double> update_time = clock::now() - update_start;
+
+        std::string path;
+        if (output_pattern)
+            frame_path(output_pattern, frame, path);
+        image_writer writer(image, format, [&](int, int) { return settings.samples_per_pixel; });
+        writer.start();
+        image.tile_done = [&](const tile& t) { writer.tile_done(t); };
+        settings.seed = seed + frame;
+        auto render_start = clock::now();
+        uint64_t rays = render_image(image, scene, cam, settings);
+        std::chrono::duration<double> render_time = clock::now() - render_start;
+        image.tile_done = nullptr;
+
+        auto write_start = clock::now();
+        FILE* out = output_pattern ? fopen(path.c_str(), "wb") : stdout;
+        if (!out || !writer.finish(out)) {
+            fprintf(stderr, "\nCould not write %s\n", output_pattern ? path.c_str() : "the image");
+            return 1;
+        }
+        if (output_pattern)
+            fclose(out);
+        std::chrono::duration<double> write_time = clock::now() - write_start;
+
+        fprintf(stderr, "\rFrame %d: %s in %.2f ms", frame, update, update_time.count() * 1e3);
+        if (accel)
+            fprintf(stderr, " (SAH cost %.2f)", bvh_sah_cost(accel->nodes));
+        fprintf(stderr, ", rendered %llu rays in %.2f s, written in %.2f ms\n",
+                static_cast<unsigned long long>(rays), render_time.count(), write_time.count() * 1e3);
+        update_total += update_time.count();
+        render_total += render_time.count();
+        write_total += write_time.count();
+        rays_total += rays;
     }
 
-    auto material1 = make_shared<dielectric>(1.5, color(1.0, 1.0, 1.0));
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    int frames = animation.last_frame - animation.first_frame + 1;
+    fprintf(stderr, "Animation: %d frames, %llu rays rendered in %.2f s (%.2f Mrays/s); "
+                    "%.2f ms per frame between renders: %.2f ms moving objects and fitting the BVH "
+                    "(%d refits, %d rebuilds), %.2f ms writing\n",
+            frames, static_cast<unsigned long long>(rays_total), render_total, rays_total / render_total * 1e-6,
+            (update_total + write_total) * 1e3 / frames, update_total * 1e3 / frames, refits, rebuilds,
+            write_total * 1e3 / frames);
+    return 0;
+}
 
-    return world;
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-t threads] [-s samples_per_pixel] [--seed n] [--no-bvh] [--scalar-leaves] [--check-leaves n]\n"
+                    "          [--dispatch virtual|closed] [--bench-dispatch n] [--integrator split|path|wavefront] [--packet 0|4|8|16]\n"
+                    "          [--sampler sobol|independent] [--nee] [--denoise] [--aov prefix] [--adaptive max_error] [--samples-map map.pgm]\n"
+                    "          [--pass-samples n] [--checkpoint file] [--resume file]\n"
+                    "          [--coordinator [host:]port] [--worker host:port] [--frames first:last] [--rebuild-ratio r]\n"
+                    "          [--format p3|p6|pfm|png] [-o file] [--scene file.scene] [--cost-map map.ppm] > image.ppm\n", prog);
+    exit(1);
 }
 
-hittable_list cornell_box() {
-    hittable_list objects;
+int main(int argc, char** argv) {
 
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light_source = make_shared<light>(color(15.0, 15.0, 15.0));
+    int max_depth = 50;
+    bool samples_given = false;
+    const char* scene_path = NULL;
+    vec3 vup(0,1,0);
+    int samples_per_pixel = 200;
+    int threads = default_thread_count();
+    int tile_size = 32;
+    int packet_size = 16;
+    uint64_t seed = 0;
+    bool use_bvh = true;
+    int check_rays = 0;
+    bool closed_dispatch = false;
+    int bench_paths = 0;
+    integrator method = integrator::split;
+    sample_sequence sequence = sample_sequence::sobol;
+    bool sample_lights = false;
+    bool denoise_image = false;
+    const char* aov_prefix = NULL;
+    double adaptive_error = 0;
+    const char* samples_map = NULL;
+    int pass_samples = 0;
+    const char* checkpoint_path = NULL;
+    const char* resume_path = NULL;
+    image_format format = image_format::p6;
+    bool format_given = false;
+    const char* output_path = NULL;
+    const char* cost_map_path = NULL;
+    const char* coordinator_address = NULL;
+    const char* worker_address = NULL;
+    int first_frame = 0, last_frame = -1;
+    double rebuild_ratio = 1.5;
+
+    for (int k = 1; k < argc; ++k) {
+        if (!strcmp(argv[k], "-t") && k+1 < argc)
+            threads = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "-s") && k+1 < argc) {
+            samples_per_pixel = atoi(argv[++k]);
+            samples_given = true;
+        }
+        else if (!strcmp(argv[k], "--seed") && k+1 < argc)
+            seed = strtoull(argv[++k], NULL, 10);
+        else if (!strcmp(argv[k], "--no-bvh"))
+            use_bvh = false;
+        else if (!strcmp(argv[k], "--scalar-leaves"))
+            simd_leaves = false;
+        else if (!strcmp(argv[k], "--check-leaves") && k+1 < argc)
+            check_rays = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--dispatch") && k+1 < argc) {
+            const char* name = argv[++k];
+            if (!strcmp(name, "closed"))
+                closed_dispatch = true;
+            else if (strcmp(name, "virtual"))
+                usage(argv[0]);
+        }
+        else if (!strcmp(argv[k], "--bench-dispatch") && k+1 < argc)
+            bench_paths = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--sampler") && k+1 < argc) {
+            const char* name = argv[++k];
+            if (!strcmp(name, "independent"))
+                sequence = sample_sequence::independent;
+            else if (strcmp(name, "sobol"))
+                usage(argv[0]);
+        }
+        else if (!strcmp(argv[k], "--nee"))
+            sample_lights = true;
+        else if (!strcmp(argv[k], "--denoise"))
+            denoise_image = true;
+        else if (!strcmp(argv[k], "--aov") && k+1 < argc)
+            aov_prefix = argv[++k];
+        else if (!strcmp(argv[k], "--adaptive") && k+1 < argc)
+            adaptive_error = atof(argv[++k]);
+        else if (!strcmp(argv[k], "--samples-map") && k+1 < argc)
+            samples_map = argv[++k];
+        else if (!strcmp(argv[k], "--format") && k+1 < argc) {
+            const char* name = argv[++k];
+            format_given = true;
+            if (!strcmp(name, "p3"))
+                format = image_format::p3;
+            else if (!strcmp(name, "p6"))
+                format = image_format::p6;
+            else if (!strcmp(name, "pfm"))
+                format = image_format::pfm;
+            else if (!strcmp(name, "png"))
+                format = image_format::png;
+            else
+                usage(argv[0]);
+        }
+        else if (!strcmp(argv[k], "--scene") && k+1 < argc)
+            scene_path = argv[++k];
+        else if (!strcmp(argv[k], "--cost-map") && k+1 < argc)
+            cost_map_path = argv[++k];
+        else if (!strcmp(argv[k], "-o") && k+1 < argc)
+            output_path = argv[++k];
+        else if (!strcmp(argv[k], "--pass-samples") && k+1 < argc)
+            pass_samples = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--checkpoint") && k+1 < argc)
+            checkpoint_path = argv[++k];
+        else if (!strcmp(argv[k], "--resume") && k+1 < argc)
+            resume_path = argv[++k];
+        else if (!strcmp(argv[k], "--coordinator") && k+1 < argc)
+            coordinator_address = argv[++k];
+        else if (!strcmp(argv[k], "--worker") && k+1 < argc)
+            worker_address = argv[++k];
+        else if (!strcmp(argv[k], "--frames") && k+1 < argc) {
+            if (sscanf(argv[++k], "%d:%d", &first_frame, &last_frame) != 2 || last_frame < first_frame)
+                usage(argv[0]);
+        }
+        else if (!strcmp(argv[k], "--rebuild-ratio") && k+1 < argc)
+            rebuild_ratio = atof(argv[++k]);
+        else if (!strcmp(argv[k], "--packet") && k+1 < argc)
+            packet_size = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--integrator") && k+1 < argc) {
+            const char* name = argv[++k];
+            if (!strcmp(name, "path"))
+                method = integrator::path;
+            else if (!strcmp(name, "wavefront"))
+                method = integrator::wavefront;
+            else if (strcmp(name, "split"))
+                usage(argv[0]);
+        }
+        else
+            usage(argv[0]);
+    }
+    if (threads < 1 || samples_per_pixel < 1 || pass_samples < 0
+        || (packet_size != 0 && packet_size != 4 && packet_size != 8 && packet_size != 16))
+        usage(argv[0]);
+    // A resumed render keeps checkpointing to the file it came from.
+    if (resume_path && !checkpoint_path)
+        checkpoint_path = resume_path;
+    bool progressive = pass_samples > 0 || checkpoint_path;
+    if (progressive && adaptive_error > 0) {
+        fprintf(stderr, "--adaptive cannot be combined with progressive rendering\n");
+        return 1;
+    }
+    if (samples_map && adaptive_error <= 0) {
+        fprintf(stderr, "--samples-map needs --adaptive\n");
+        return 1;
+    }
+    if (progressive && pass_samples == 0)
+        pass_samples = 16;
+    bool distributed = coordinator_address || worker_address;
+    if (distributed && (progressive || adaptive_error > 0 || denoise_image || aov_prefix || cost_map_path)) {
+        fprintf(stderr, "--coordinator and --worker render single passes without denoising or statistics maps\n");
+        return 1;
+    }
+    if (coordinator_address && worker_address) {
+        fprintf(stderr, "--coordinator and --worker cannot be combined\n");
+        return 1;
+    }
+#ifndef RT_STATS
+    if (cost_map_path) {
+        fprintf(stderr, "--cost-map needs a build with statistics (make STATS=1)\n");
+        return 1;
+    }
+#endif
+    if (output_path && !format_given && !format_from_name(output_path, format)) {
+        fprintf(stderr, "Unknown image format for %s; use --format\n", output_path);
+        return 1;
+    }
 
-    auto material1 = make_shared<dielectric>(1.5, color(1.0, 1.0, 1.0));
-    objects.add(make_shared<sphere>(point3(280, 200, 280), 50.0, material1));
+    scene_description description;
+    material_table materials;
+    rng scene_gen(seed);
+    int32_t scene_id = world_type;
+
+    if (scene_path) {
+        if (!load_scene(scene_path, materials, description, threads))
+            return 1;
+        if (description.samples_per_pixel && !samples_given)
+            samples_per_pixel = description.samples_per_pixel;
+        if (description.max_depth)
+            max_depth = description.max_depth;
+
+        // Checkpoints and distributed workers are tied to the scene by a
+        // hash of the scene file's text; the meshes it loads are not part of
+        // it. load_scene() has read the file, so it can be read again.
+        std::ifstream scene_text(scene_path, std::ios::binary);
+        uint32_t hash = 2166136261u;
+        for (std::istreambuf_iterator<char> c(scene_text), end; c != end; ++c)
+            hash = (hash ^ static_cast<unsigned char>(*c)) * 16777619u;
+        scene_id = static_cast<int32_t>(hash | 0x80000000u);
+    } else {
+        builtin_scene(world_type, materials, scene_gen, description);
+    }
 
-    objects.add(make_shared<rectangle>(NONE, NONE, 0, 555, 0, 555, 1, 555, green));
-    objects.add(make_shared<rectangle>(NONE, NONE, 0, 555, 0, 555, 1, 0, red));
-    objects.add(make_shared<rectangle>(213, 343, NONE, NONE, 227, 332, 2, 554, light_source));
-    objects.add(make_shared<rectangle>(0, 555, NONE, NONE, 0, 555, 2, 0, white));
-    objects.add(make_shared<rectangle>(0, 555, NONE, NONE, 0, 555, 2, 555, white));
-    objects.add(make_shared<rectangle>(0, 555, 0, 555, NONE, NONE, 3, 555, white));
+    // An animation is set up at its first frame, which the acceleration
+    // structure is built for.
+    scene_animation& animation = description.animation;
+    if (last_frame >= first_frame) {
+        if (animation.empty()) {
+            fprintf(stderr, "--frames needs an animated scene\n");
+            return 1;
+        }
+        animation.first_frame = first_frame;
+        animation.last_frame = last_frame;
+    }
+    point3 lookfrom = description.lookfrom, lookat = description.lookat;
+    if (!animation.empty()) {
+        if (progressive || adaptive_error > 0 || distributed || denoise_image || aov_prefix || cost_map_path
+            || closed_dispatch) {
+            fprintf(stderr, "Animations render single passes per frame, without denoising, statistics maps "
+                            "or closed dispatch\n");
+            return 1;
+        }
+        std::string path;
+        if (output_path && !frame_path(output_path, animation.first_frame, path)) {
+            fprintf(stderr, "-o needs a frame number pattern such as frame%%04d.png for an animation\n");
+            return 1;
+        }
+        animation.set_frame(animation.first_frame);
+        animation.camera_at(animation.first_frame, lookfrom, lookat);
+    }
 
-    return objects;
-}
+    const hittable_list& world = description.world;
+    int image_width = description.image_width;
+    int image_height = std::max(1, static_cast<int>(image_width / description.aspect_ratio));
+    black_background = description.black_background;
+    camera cam(lookfrom, lookat, vup, description.vfov, description.aspect_ratio,
+               description.aperture, description.focus_dist);
+
+    if (check_rays > 0)
+        return check_leaf_kernels(world, cam, check_rays, seed) == 0 ? 0 : 1;
+    if (bench_paths > 0) {
+        bench_dispatch(world, cam, bench_paths, max_depth, seed);
+        return 0;
+    }
 
-hittable_list triangle_scene() {
-    hittable_list objects;
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    objects.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
-
-    for (int a = -41; a < 41; a+=5) {
-        for (int b = -41; b < 41; b+=5) {
-            auto choose_mat = random_double();
-            point3 p1(a + 0.9*random_double(), 0.4 + 3.0*random_double(), b + 0.9*random_double());
-            point3 p2(p1.x() + random_double(1.0, 4.0), p1.y(), p1.z() - random_double(1.0, 4.0));
-            point3 p3(p1.x() + random_double(0, 4.0), p1.y() + random_double(1.0, 4.0), p1.z() + random_double(0, 4.0));
-            shared_ptr<material> sphere_material;
-
-            if (choose_mat < 0.8) {
-                // diffuse
-                auto albedo = color::random() * color::random();
-                sphere_material = make_shared<lambertian>(albedo);
-                objects.add(make_shared<triangle>(p1, p2, p3, sphere_material));
-            } else {
-                // metal
-                auto albedo = color::random(0.5, 1);
-                auto fuzz = random_double(0, 0.5);
-                sphere_material = make_shared<metal>(albedo, fuzz);
-                objects.add(make_shared<triangle>(p1, p2, p3, sphere_material));
-            }
-        }
+    light_list lights;
+    if (sample_lights) {
+        lights = light_list(world);
+        fprintf(stderr, "Next-event estimation: %zu lights\n", lights.lights.size());
     }
 
-    return objects;
-}
+    render_settings settings;
+    settings.method = method;
+    settings.first_sample = 0;
+    settings.samples_per_pixel = samples_per_pixel;
+    settings.max_depth = max_depth;
+    settings.threads = threads;
+    settings.tile_size = tile_size;
+    settings.packet_size = packet_size;
+    settings.lights = lights.empty() ? nullptr : &lights;
+    settings.seed = seed;
+    settings.sequence = sequence;
+
+    typedef std::chrono::steady_clock clock;
+    shared_ptr<hittable> scene = make_shared<hittable_list>(world);
+    shared_ptr<bvh> accel;
+    shared_ptr<closed_scene> closed;
+    if (coordinator_address) {
+        // The coordinator traces no rays, so it needs no acceleration structure.
+    } else if (closed_dispatch) {
+        auto build_start = clock::now();
+        closed = make_shared<closed_scene>(world);
+        std::chrono::duration<double, std::milli> build_time = clock::now() - build_start;
+        fprintf(stderr, "Closed scene: %zu spheres, %zu triangles, %zu rectangles, %zu other, built in %.2f ms\n",
+                closed->spheres.size(), closed->triangles.size(), closed->rectangles.size(),
+                closed->others.size(), build_time.count());
+    } else if (use_bvh) {
+        auto build_start = clock::now();
+        accel = make_shared<bvh>(world);
+        std::chrono::duration<double, std::milli> build_time = clock::now() - build_start;
+        fprintf(stderr, "BVH: %zu primitives, %zu nodes, built in %.2f ms\n",
+                world.objects.size(), accel->nodes.size(), build_time.count());
+        scene = accel;
+    }
 
-int main() {
+    if (!animation.empty())
+        return render_animation(description, *scene, accel.get(), settings, vup, format, output_path, rebuild_ratio);
 
-    int max_depth = 50;
-    vec3 vup(0,1,0);
-    auto aperture = 0.1;
-    int samples_per_pixel = 200;
+    // Render
+    framebuffer image(image_width, image_height);
+    if (cost_map_path)
+        start_cost_map(image_width, image_height);
+    adaptive_sampler sampler(image_width, image_height, adaptive_error, samples_per_pixel);
+    checkpoint_info progress;
+    progress.width = image_width;
+    progress.height = image_height;
+    progress.seed = seed;
+    progress.scene = scene_id;
+    // Light sampling and the sample sequence change the estimate of each
+    // sample, so they are part of the integrator a checkpoint belongs to.
+    progress.method = static_cast<int32_t>(method) | (settings.lights ? 0x100 : 0)
+                    | (sequence == sample_sequence::sobol ? 0x200 : 0);
+    progress.max_depth = max_depth;
+    progress.samples = 0;
+    if (resume_path) {
+        checkpoint_info saved;
+        if (!load_checkpoint(resume_path, saved, image)) {
+            fprintf(stderr, "Could not read checkpoint %s\n", resume_path);
+            return 1;
+        }
+        if (saved.width != progress.width || saved.height != progress.height || saved.seed != progress.seed
+            || saved.scene != progress.scene || saved.method != progress.method
+            || saved.max_depth != progress.max_depth) {
+            fprintf(stderr, "Checkpoint %s belongs to a different render\n", resume_path);
+            return 1;
+        }
+        progress = saved;
+        fprintf(stderr, "Resuming from %d samples per pixel\n", progress.samples);
+    }
 
-    double aspect_ratio;
-    int image_width;
-    int image_height;
-    point3 lookfrom;
-    point3 lookat;
-    double dist_to_focus;
-    double vfov;
-    hittable_list world;
-    
-    switch(world_type){
-        case 0:
-            aspect_ratio = 3.0 / 2.0;
-            image_width = 1200;
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0,0,0);
-            dist_to_focus = 10.0;
-            vfov = 20.0;
-            world = random_scene();
-            break;
-        case 1:
-            aspect_ratio = 1.0;
-            image_width = 600;
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            lookfrom = point3(278, 278, -800);
-            lookat = point3(278, 278, 0);
-            dist_to_focus = 10.0;
-            vfov = 40.0;
-            world = cornell_box();
-            break;
-        case 2:
-            aspect_ratio = 3.0 / 2.0;
-            image_width = 1200;
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            lookfrom = point3(39, 6, 9);
-            lookat = point3(0,0,0);
-            dist_to_focus = 30.0;
-            vfov = 20.0;
-            world = triangle_scene();
-            break;
-    }
-
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus);
+    // Workers and coordinator show each other what they render by the render's
+    // checkpoint_info, with the samples per pixel of the finished image.
+    checkpoint_info job_info = progress;
+    job_info.samples = samples_per_pixel;
+    if (worker_address) {
+        show_progress = false;
+        bool ok = run_worker(worker_address, job_info, image, [&](framebuffer& fb) {
+            return closed ? render_image(fb, *closed, cam, settings) : render_image(fb, *scene, cam, settings);
+        });
+        return ok ? 0 : 1;
+    }
 
+    // A single-pass render hands finished tiles to the encoder thread as it
+    // goes; progressive and adaptive renders revisit tiles, and denoised
+    // ones are filtered as a whole, so they are encoded once they are done.
+    auto pixel_samples = [&](int i, int j) {
+        return progressive ? progress.samples
+             : adaptive_error > 0 ? sampler.sample_count(i, j) : samples_per_pixel;
+    };
+    image_writer writer(image, format, pixel_samples);
+    if (!progressive && adaptive_error <= 0 && !denoise_image && !coordinator_address) {
+        writer.start();
+        image.tile_done = [&](const tile& t) { writer.tile_done(t); };
+    }
 
-    // Render
-    printf("P3\n%d %d\n255\n", image_width, image_height);
-
-    for (int j = image_height-1; j >= 0; --j) {
-        fprintf(stderr, "\rScanlines remaining: %d ", j);
-        for (int i = 0; i < image_width; ++i) {
-            color pixel_color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width-1);
-                auto v = (j + random_double()) / (image_height-1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, world, max_depth, color(1.0, 1.0, 1.0));
+    auto render_start = clock::now();
+    uint64_t rays = 0;
+    if (coordinator_address) {
+        if (!coordinate_render(coordinator_address, job_info, image, 2 * tile_size, rays)) {
+            fprintf(stderr, "Could not listen on %s\n", coordinator_address);
+            return 1;
+        }
+    } else if (progressive)
+        rays = closed ? render_progressive(image, *closed, cam, settings, progress, samples_per_pixel,
+                                           pass_samples, checkpoint_path)
+                      : render_progressive(image, *scene, cam, settings, progress, samples_per_pixel,
+                                           pass_samples, checkpoint_path);
+    else if (adaptive_error > 0)
+        rays = closed ? render_adaptive(image, *closed, cam, settings, sampler)
+                      : render_adaptive(image, *scene, cam, settings, sampler);
+    else
+        rays = closed ? render_image(image, *closed, cam, settings)
+                      : render_image(image, *scene, cam, settings);
+    std::chrono::duration<double> render_time = clock::now() - render_start;
+    fprintf(stderr, "\nRendered %llu rays in %.2f s (%.2f Mrays/s)",
+            static_cast<unsigned long long>(rays), render_time.count(),
+            rays / render_time.count() * 1e-6);
+    if (adaptive_error > 0) {
+        fprintf(stderr, "\nAdaptive: %d passes, %lld samples (%.1f%% of %lld)",
+                sampler.pass_total(), sampler.total_samples(),
+                100.0 * sampler.total_samples() / sampler.fixed_budget(), sampler.fixed_budget());
+        if (samples_map && !sampler.write_samples_map(samples_map))
+            fprintf(stderr, "\nCould not write %s", samples_map);
+    }
+#ifdef RT_STATS
+    fprintf(stderr, "\n");
+    total_stats.print(stderr);
+    if (cost_map_path && !write_cost_map(cost_map_path))
+        fprintf(stderr, "Could not write %s\n", cost_map_path);
+#endif
+
+    // The auxiliary buffers take the camera rays of the first few samples
+    // again, tracing only their first hits, after the image is rendered; a
+    // checkpoint saved by then holds the image as rendered.
+    if (denoise_image || aov_prefix) {
+        aov_buffers aov(image_width, image_height);
+        auto aov_start = clock::now();
+        int aov_samples = std::min(samples_per_pixel, 8);
+        uint64_t aov_rays = closed ? render_aovs(aov, *closed, cam, settings, aov_samples)
+                                   : render_aovs(aov, *scene, cam, settings, aov_samples);
+        std::chrono::duration<double> aov_time = clock::now() - aov_start;
+        fprintf(stderr, "\nAOVs: %d samples per pixel, %llu rays in %.2f s", aov_samples,
+                static_cast<unsigned long long>(aov_rays), aov_time.count());
+
+        if (aov_prefix) {
+            const char* names[3] = { "albedo", "normal", "depth" };
+            const framebuffer* buffers[3] = { &aov.albedo, &aov.normal, &aov.depth };
+            for (int k = 0; k < 3; ++k) {
+                std::string path = std::string(aov_prefix) + "." + names[k] + ".pfm";
+                image_writer aov_writer(*buffers[k], image_format::pfm, [&](int, int) { return aov.samples; });
+                FILE* aov_out = fopen(path.c_str(), "wb");
+                if (!aov_out || !aov_writer.finish(aov_out))
+                    fprintf(stderr, "\nCould not write %s", path.c_str());
+                if (aov_out)
+                    fclose(aov_out);
             }
-            write_color(pixel_color, samples_per_pixel);
         }
+
+        if (denoise_image) {
+            auto denoise_start = clock::now();
+            denoise_settings filter;
+            filter.threads = threads;
+            denoise(image, pixel_samples, aov, filter);
+            std::chrono::duration<double, std::milli> denoise_time = clock::now() - denoise_start;
+            fprintf(stderr, "\nDenoised in %.2f ms", denoise_time.count());
+        }
+    }
+
+    auto write_start = clock::now();
+    FILE* out = output_path ? fopen(output_path, "wb") : stdout;
+    if (!out || !writer.finish(out)) {
+        fprintf(stderr, "\nCould not write %s\n", output_path ? output_path : "the image");
+        return 1;
     }
+    if (output_path)
+        fclose(out);
+    std::chrono::duration<double, std::milli> write_time = clock::now() - write_start;
+    fprintf(stderr, "\nImage written in %.2f ms after rendering", write_time.count());
     fprintf(stderr, "\nFinished!!!\n");
 }
\ No newline at end of file
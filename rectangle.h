@@ -2,25 +2,45 @@
 #define RECTANGLE_H
 
 #include "hittable.h"
+#include "stats.h"
 #include "vec3.h"
 
 class rectangle : public hittable {
     public:
         rectangle() {}
-        rectangle(double xa, double xb, double ya, double yb, double za, double zb, int nd, double k0, shared_ptr<material> m)
+        rectangle(real xa, real xb, real ya, real yb, real za, real zb, int nd, real k0, const material* m)
             : x0(xa), x1(xb), y0(ya), y1(yb), z0(za), z1(zb), norm_direction(nd), k(k0), mat_ptr(m) {};
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+        virtual vec3 random(const point3& origin, rng& gen) const override;
+
+        double area() const {
+            switch(norm_direction) {
+                case 1:
+                    return double(y1 - y0) * (z1 - z0);
+                case 2:
+                    return double(x1 - x0) * (z1 - z0);
+                default:
+                    return double(x1 - x0) * (y1 - y0);
+            }
+        }
+
+        // Distance t along r to the rectangle, if it lies in [t_min, t_max].
+        bool intersect(const ray& r, real t_min, real t_max, real& t) const;
 
     public:
         int norm_direction; // 1: x=k,  2: y=k,  3: z=k
-        double x0, x1, y0, y1, z0, z1, k;
-        shared_ptr<material> mat_ptr;
+        real x0, x1, y0, y1, z0, z1, k;
+        const material* mat_ptr;
 };
 
-bool rectangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    double t, x, y, z;
+bool rectangle::intersect(const ray& r, real t_min, real t_max, real& t) const {
+    STAT(stat_tests(stat_primitive::rectangle, 1));
+    real x, y, z;
     switch(norm_direction) {
         case 1:
             t = (k - r.origin().x()) / r.direction().x();
@@ -52,6 +72,13 @@ bool rectangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
                 return false;
             break;
     }
+    return true;
+}
+
+bool rectangle::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    real t;
+    if (!intersect(r, t_min, t_max, t))
+        return false;
 
     rec.t = t;
     rec.p = r.at(rec.t);
@@ -73,4 +100,56 @@ bool rectangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
     return true;
 }
 
+bool rectangle::occluded(const ray& r, real t_min, real t_max) const {
+    real t;
+    return intersect(r, t_min, t_max, t);
+}
+
+bool rectangle::bounding_box(aabb& output_box) const {
+    // The bounding box must have non-zero width in each dimension, so pad the
+    // axis of the normal a small amount.
+    const real pad = 0.0001;
+    switch(norm_direction) {
+        case 1:
+            output_box = aabb(point3(k-pad, y0, z0), point3(k+pad, y1, z1));
+            break;
+        case 2:
+            output_box = aabb(point3(x0, k-pad, z0), point3(x1, k+pad, z1));
+            break;
+        case 3:
+            output_box = aabb(point3(x0, y0, k-pad), point3(x1, y1, k+pad));
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+double rectangle::pdf_value(const point3& origin, const vec3& v) const {
+    real t;
+    if (!intersect(ray(origin, v), hit_epsilon, infinity, t))
+        return 0;
+
+    // The area density over the solid angle the surface element subtends.
+    double distance_squared = t * t * v.length_squared();
+    double cosine = fabs(v[norm_direction - 1]) / v.length();
+    return cosine > 0 ? distance_squared / (cosine * area()) : 0;
+}
+
+vec3 rectangle::random(const point3& origin, rng& gen) const {
+    point3 p;
+    switch(norm_direction) {
+        case 1:
+            p = point3(k, random_double(gen, y0, y1), random_double(gen, z0, z1));
+            break;
+        case 2:
+            p = point3(random_double(gen, x0, x1), k, random_double(gen, z0, z1));
+            break;
+        default:
+            p = point3(random_double(gen, x0, x1), random_double(gen, y0, y1), k);
+            break;
+    }
+    return p - origin;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "rt.h"
+
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A rectangular block of pixels [x0,x1) x [y0,y1).
+struct tile {
+    int x0, y0, x1, y1;
+};
+
+class framebuffer {
+    public:
+        framebuffer() : width(0), height(0), region{0, 0, 0, 0} {}
+        framebuffer(int w, int h) : width(w), height(h), pixels(w*h), region{0, 0, w, h} {}
+
+        color& at(int i, int j) { return pixels[j*width + i]; }
+        const color& at(int i, int j) const { return pixels[j*width + i]; }
+
+    public:
+        int width;
+        int height;
+        std::vector<color> pixels;
+
+        // Part of the image render_tile_blocks() renders; all of it unless
+        // changed, e.g. by a worker rendering one job of a distributed frame.
+        tile region;
+
+        // If set, render_tile_blocks() calls it from the worker thread as
+        // each tile is finished, e.g. to encode the image while later tiles
+        // are still rendering.
+        std::function<void(const tile&)> tile_done;
+};
+
+// Splits region into tiles of at most tile_size x tile_size pixels, row by
+// row from the top.
+inline std::vector<tile> make_tiles(const tile& region, int tile_size) {
+    std::vector<tile> tiles;
+    for (int y = region.y1; y > region.y0; y -= tile_size) {
+        for (int x = region.x0; x < region.x1; x += tile_size) {
+            tile t;
+            t.x0 = x;
+            t.x1 = std::min(x + tile_size, region.x1);
+            t.y0 = std::max(y - tile_size, region.y0);
+            t.y1 = y;
+            tiles.push_back(t);
+        }
+    }
+    return tiles;
+}
+
+inline std::vector<tile> make_tiles(int width, int height, int tile_size) {
+    tile all = { 0, 0, width, height };
+    return make_tiles(all, tile_size);
+}
+
+// Work-stealing tile queue. Every worker owns a deque seeded with a contiguous
+// run of tiles; it pops from the front of its own deque and, once that is
+// empty, steals from the back of the other workers' deques.
+class tile_scheduler {
+    public:
+        tile_scheduler(const std::vector<tile>& tiles, int workers);
+
+        bool next(int worker, tile& t);
+
+    private:
+        struct queue {
+            std::mutex lock;
+            std::deque<tile> tiles;
+        };
+
+        std::vector<std::unique_ptr<queue>> queues;
+};
+
+tile_scheduler::tile_scheduler(const std::vector<tile>& tiles, int workers) {
+    for (int w = 0; w < workers; ++w)
+        queues.push_back(std::unique_ptr<queue>(new queue));
+
+    size_t n = tiles.size();
+    for (size_t k = 0; k < n; ++k)
+        queues[k * workers / n]->tiles.push_back(tiles[k]);
+}
+
+bool tile_scheduler::next(int worker, tile& t) {
+    {
+        queue& own = *queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tiles.empty()) {
+            t = own.tiles.front();
+            own.tiles.pop_front();
+            return true;
+        }
+    }
+
+    int workers = static_cast<int>(queues.size());
+    for (int k = 1; k < workers; ++k) {
+        queue& victim = *queues[(worker + k) % workers];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tiles.empty()) {
+            t = victim.tiles.back();
+            victim.tiles.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+// Rays traced by the calling thread. Integrators bump it once per ray cast into
+// the scene, and render_tiles() sums it over its workers.
+thread_local uint64_t rays_traced = 0;
+
+// Whether render_tile_blocks() reports the tiles left on stderr.
+bool show_progress = true;
+
+inline int default_thread_count() {
+    int n = static_cast<int>(std::thread::hardware_concurrency());
+    return n > 0 ? n : 1;
+}
+
+// Render every tile of fb.region with shade_tile(worker, tile) on a pool of threads,
+// where worker is the index of the calling thread in [0, threads). Returns
+// once all tiles are finished, so the caller can emit the framebuffer
+// afterwards, with the total number of rays traced.
+template <typename TileFn>
+uint64_t render_tile_blocks(framebuffer& fb, int threads, int tile_size, TileFn shade_tile) {
+    std::vector<tile> tiles = make_tiles(fb.region, tile_size);
+    if (threads < 1)
+        threads = default_thread_count();
+    threads = std::min<int>(threads, static_cast<int>(tiles.size()));
+
+    tile_scheduler scheduler(tiles, threads);
+    std::atomic<int> remaining(static_cast<int>(tiles.size()));
+    std::atomic<uint64_t> total_rays(0);
+
+    auto worker = [&](int id) {
+        rays_traced = 0;
+        tile t;
+        while (scheduler.next(id, t)) {
+            shade_tile(id, t);
+            if (fb.tile_done)
+                fb.tile_done(t);
+            int left = --remaining;
+            if (show_progress)
+                fprintf(stderr, "\rTiles remaining: %d   ", left);
+        }
+        total_rays += rays_traced;
+        STAT(merge_thread_stats());
+    };
+
+    std::vector<std::thread> pool;
+    for (int id = 1; id < threads; ++id)
+        pool.push_back(std::thread(worker, id));
+    worker(0);
+    for (auto& th : pool)
+        th.join();
+    return total_rays;
+}
+
+// Render every pixel of fb with shade(i, j); see render_tile_blocks().
+template <typename PixelFn>
+uint64_t render_tiles(framebuffer& fb, int threads, int tile_size, PixelFn shade) {
+    return render_tile_blocks(fb, threads, tile_size, [&](int, const tile& t) {
+        for (int j = t.y1-1; j >= t.y0; --j)
+            for (int i = t.x0; i < t.x1; ++i) {
+                STAT(uint64_t work = thread_stats.work());
+                fb.at(i, j) = shade(i, j);
+                STAT(stat_pixel_cost(i, j, thread_stats.work() - work));
+            }
+    });
+}
+
+// Number of worker threads render_tile_blocks() will use.
+inline int worker_count(const framebuffer& fb, int threads, int tile_size) {
+    if (threads < 1)
+        threads = default_thread_count();
+    return std::min<int>(threads, static_cast<int>(make_tiles(fb.region, tile_size).size()));
+}
+
+#endif
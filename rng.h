@@ -0,0 +1,120 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// How the numbers of a sample's stream are drawn (see rng).
+enum class sample_sequence { independent, sobol };
+
+// Counter-based random number generator. Every draw is a pure function of a
+// key and a running counter, so a stream keyed by (seed, pixel, sample) gives
+// the same numbers whichever thread renders it and in whatever tile order.
+// The mixing function is the splitmix64 finalizer.
+//
+// A sobol stream draws low-discrepancy numbers instead: draw d of sample s
+// of a pixel is coordinate d of point s of a scrambled Sobol sequence of that
+// pixel, so that the pixel's samples cover every dimension evenly. Following
+// Burley, "Practical Hash-based Owen Scrambling" (JCGT 2020), the draws come
+// in pairs, each the two-dimensional Sobol sequence with its points shuffled
+// and its coordinates Owen-scrambled by hashes of the pixel and the pair; the
+// pair (2k, 2k+1) is stratified in two dimensions, which suits the pixel
+// jitter, lens and direction samples drawn two at a time, and different
+// pairs are decorrelated by their shuffles. Every draw is still uniform on
+// [0,1), so estimates stay unbiased.
+class rng {
+    public:
+        rng() : key(0), counter(0), reversed_sample(0), pending(0), sequence(sample_sequence::independent) {}
+        explicit rng(uint64_t seed) : key(mix(seed)), counter(0), reversed_sample(0), pending(0), sequence(sample_sequence::independent) {}
+        rng(uint64_t seed, uint64_t pixel, uint64_t sample, sample_sequence sequence = sample_sequence::independent)
+            : key(sequence == sample_sequence::sobol ? mix(mix(seed) ^ pixel) : mix(mix(mix(seed) ^ pixel) ^ sample)),
+              counter(0), reversed_sample(reverse_bits(static_cast<uint32_t>(sample))), pending(0), sequence(sequence) {}
+
+        uint64_t next_uint64() {
+            return mix(key + (++counter) * 0x9e3779b97f4a7c15ULL);
+        }
+
+        // Uniform double in [0,1), with 53 random bits from an independent
+        // stream and 32 from a sobol one.
+        double next_double() {
+            if (sequence == sample_sequence::sobol)
+                return next_sobol() * (1.0 / 4294967296.0);
+            return (next_uint64() >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+    public:
+        uint64_t key;       // of the stream, or of the pixel for sobol
+        uint64_t counter;   // number of values drawn so far
+        uint32_t reversed_sample;   // index of the sample in its pixel, bit-reversed, for sobol
+        uint32_t pending;   // second draw of the current sobol pair
+        sample_sequence sequence;
+
+    private:
+        static uint64_t mix(uint64_t z) {
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+
+        static uint32_t reverse_bits(uint32_t x) {
+            x = (x << 16) | (x >> 16);
+            x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+            x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+            x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+            x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+            return x;
+        }
+
+        // Owen scrambling of the bits of x, read in reverse as a binary
+        // fraction (the lowest bit is the fraction's first): each bit is
+        // flipped by a hash of seed and the bits below it (Laine and Karras).
+        static uint32_t owen_scramble_reversed(uint32_t x, uint32_t seed) {
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return x;
+        }
+
+        // Second dimension of the Sobol sequence, from the primitive
+        // polynomial x + 1, bit-reversed, by bytes of the index: bytes[b][v]
+        // is the xor of the direction numbers of the bits set in byte b of
+        // the index if it is v.
+        static uint32_t sobol_second_reversed(uint32_t index) {
+            struct tables {
+                uint32_t bytes[4][256];
+                tables() {
+                    uint32_t v[32];
+                    v[0] = 1;
+                    for (int k = 1; k < 32; ++k)
+                        v[k] = v[k-1] ^ (v[k-1] << 1);
+                    for (int b = 0; b < 4; ++b)
+                        for (int x = 0; x < 256; ++x) {
+                            bytes[b][x] = 0;
+                            for (int k = 0; k < 8; ++k)
+                                if (x & (1 << k))
+                                    bytes[b][x] ^= v[8*b + k];
+                        }
+                }
+            };
+            static const tables t;
+            return t.bytes[0][index & 0xff] ^ t.bytes[1][(index >> 8) & 0xff]
+                 ^ t.bytes[2][(index >> 16) & 0xff] ^ t.bytes[3][index >> 24];
+        }
+
+        // The two coordinates of a pair are made together; the second waits
+        // in pending for the next draw. Scrambling works on reversed bits,
+        // the order both the shuffled index and the first dimension (the van
+        // der Corput sequence, the index reversed) come in for free.
+        uint32_t next_sobol() {
+            if (counter++ % 2)
+                return pending;
+            uint64_t pair_key = mix(key + (counter / 2 + 1) * 0x9e3779b97f4a7c15ULL);
+            uint32_t index = reverse_bits(owen_scramble_reversed(reversed_sample, static_cast<uint32_t>(pair_key)));
+            uint32_t scramble = static_cast<uint32_t>(pair_key >> 32);
+            pending = reverse_bits(owen_scramble_reversed(sobol_second_reversed(index), scramble ^ 0x9e3779b9u));
+            return reverse_bits(owen_scramble_reversed(index, scramble));
+        }
+};
+
+#endif
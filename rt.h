@@ -4,7 +4,8 @@
 #include <cmath>
 #include <limits>
 #include <memory>
-#include <random>
+
+#include "rng.h"
 
 // Usings
 
@@ -12,23 +13,48 @@ using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
+// Scalar type of the geometry: points, directions, ray parameters and the
+// primitives. Building with -DRT_FLOAT (make ray_tracing_float) makes it single
+// precision.
+#ifdef RT_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
+// Nearest hit accepted along a ray, so that a ray leaving a surface does not
+// hit that surface again.
+const real hit_epsilon = 0.001;
+
+// A ray is treated as parallel to a triangle when the Moller-Trumbore
+// determinant is below this fraction of |dir| |e1| |e2|, the largest it can
+// be, so that the test does not depend on the scale of the scene or the
+// length of the ray direction. The kernels compare squares.
+const real det_epsilon = 1e-7;
+
+#ifdef RT_FLOAT
+// Offset of a spawned ray's origin from the surface, relative to the size of
+// the hit point; see hit_record::spawn_origin().
+const real spawn_epsilon = 1e-4f;
+#endif
+
 // Utility Functions
 
 inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+inline double random_double(rng& gen) {
+    return gen.next_double();
 }
 
-inline double random_double(double min, double max) {
-    return min + (max-min)*random_double();
+inline double random_double(rng& gen, double min, double max) {
+    return min + (max-min)*random_double(gen);
 }
 
 inline double clamp(double x, double min, double max) {
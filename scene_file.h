@@ -0,0 +1,302 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "rt.h"
+
+#include "animation.h"
+#include "arena.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "obj_loader.h"
+#include "rectangle.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "triangle_mesh.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+// A scene read from a text file: one statement per line, '#' starts a
+// comment. Materials are named and must be defined before they are used;
+// mesh paths are relative to the scene file.
+//
+//   image <width> <aspect_ratio>
+//   samples <n>
+//   max_depth <n>
+//   background sky|black
+//   camera <lookfrom xyz> <lookat xyz> <vfov> <aperture> <focus_dist>
+//   material <name> lambertian <r g b>
+//   material <name> metal <r g b> <fuzz>
+//   material <name> dielectric <ior> <r g b>
+//   material <name> light <r g b>
+//   sphere <center xyz> <radius> <material>
+//   triangle <xyz> <xyz> <xyz> <material>
+//   rectangle x|y|z <k> <a0 a1> <b0 b1> <material>
+//       an axis-aligned rectangle in the plane axis = k spanning the other two
+//       axes in order (y z, x z or x y)
+//   mesh <file.obj> <material> [scale <s>] [rotate <axis xyz> <degrees>] [translate <xyz>]
+//       transforms apply to the vertices in the order given
+//   frames <first> <last>
+//       makes the scene an animation of the frames first to last
+//   camera_key <frame> <lookfrom xyz> <lookat xyz>
+//       the camera at a frame of an animation, interpolated linearly between
+//       keys; the other camera parameters stay as set by camera
+//   key <frame> [translate <xyz>] [rotate <axis xyz> <degrees>] [scale <s>]
+//       the placement at a frame of the object of the statement before (or of
+//       the keys before): scaled, rotated around the origin and translated,
+//       on top of the object's own coordinates; keys of one object follow
+//       each other with rising frames
+struct scene_description {
+    scene_description()
+        : image_width(1200), aspect_ratio(16.0 / 9.0),
+          lookfrom(0, 0, 1), lookat(0, 0, 0), vfov(40), aperture(0), focus_dist(1),
+          samples_per_pixel(0), max_depth(0), black_background(false), arena(make_shared<scene_arena>()) {}
+
+    hittable_list world;
+    int image_width;
+    double aspect_ratio;
+    point3 lookfrom;
+    point3 lookat;
+    double vfov;
+    double aperture;
+    double focus_dist;
+    int samples_per_pixel;      // 0 when the file does not say
+    int max_depth;              // 0 when the file does not say
+    bool black_background;
+    scene_animation animation;
+    shared_ptr<scene_arena> arena;  // holds the objects of world
+};
+
+// Reads the scene at path, creating its materials in materials. Meshes are
+// loaded with the given number of threads. Errors are reported on stderr with
+// the line they occur on.
+bool load_scene(const char* path, material_table& materials, scene_description& scene, int threads) {
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "Could not open scene %s\n", path);
+        return false;
+    }
+
+    std::string dir(path);
+    size_t slash = dir.find_last_of('/');
+    dir = slash == std::string::npos ? std::string() : dir.substr(0, slash + 1);
+
+    std::map<std::string, const material*> named;
+    std::string text;
+    int line_number = 0;
+    // Object of world the next key statement is for, or -1.
+    int keyed = -1;
+
+    while (std::getline(in, text)) {
+        ++line_number;
+        size_t hash = text.find('#');
+        if (hash != std::string::npos)
+            text.erase(hash);
+        std::istringstream line(text);
+        std::string keyword;
+        if (!(line >> keyword))
+            continue;
+
+        auto fail = [&](const char* what) {
+            fprintf(stderr, "%s:%d: %s\n", path, line_number, what);
+            return false;
+        };
+        auto read_vec = [&](vec3& v) {
+            double x, y, z;
+            if (!(line >> x >> y >> z))
+                return false;
+            v = vec3(x, y, z);
+            return true;
+        };
+        auto read_material = [&](const material*& m) {
+            std::string name;
+            if (!(line >> name))
+                return false;
+            auto found = named.find(name);
+            if (found == named.end())
+                return false;
+            m = found->second;
+            return true;
+        };
+
+        int object_count = static_cast<int>(scene.world.objects.size());
+        if (keyword != "key")
+            keyed = -1;
+
+        if (keyword == "image") {
+            if (!(line >> scene.image_width >> scene.aspect_ratio) || scene.image_width < 1 || scene.aspect_ratio <= 0)
+                return fail("expected: image <width> <aspect_ratio>");
+        } else if (keyword == "samples") {
+            if (!(line >> scene.samples_per_pixel) || scene.samples_per_pixel < 1)
+                return fail("expected: samples <n>");
+        } else if (keyword == "max_depth") {
+            if (!(line >> scene.max_depth) || scene.max_depth < 1)
+                return fail("expected: max_depth <n>");
+        } else if (keyword == "background") {
+            std::string kind;
+            line >> kind;
+            if (kind != "sky" && kind != "black")
+                return fail("expected: background sky|black");
+            scene.black_background = kind == "black";
+        } else if (keyword == "camera") {
+            if (!read_vec(scene.lookfrom) || !read_vec(scene.lookat)
+                || !(line >> scene.vfov >> scene.aperture >> scene.focus_dist))
+                return fail("expected: camera <lookfrom> <lookat> <vfov> <aperture> <focus_dist>");
+        } else if (keyword == "frames") {
+            if (!(line >> scene.animation.first_frame >> scene.animation.last_frame)
+                || scene.animation.last_frame < scene.animation.first_frame)
+                return fail("expected: frames <first> <last>");
+        } else if (keyword == "camera_key") {
+            camera_key k;
+            if (!(line >> k.frame) || !read_vec(k.lookfrom) || !read_vec(k.lookat))
+                return fail("expected: camera_key <frame> <lookfrom> <lookat>");
+            if (!scene.animation.camera_keys.empty() && k.frame <= scene.animation.camera_keys.back().frame)
+                return fail("camera keys must follow each other with rising frames");
+            scene.animation.camera_keys.push_back(k);
+        } else if (keyword == "key") {
+            transform_key k;
+            k.translation = vec3(0, 0, 0);
+            k.axis = vec3(0, 1, 0);
+            k.degrees = 0;
+            k.scale = 1;
+            if (!(line >> k.frame))
+                return fail("expected: key <frame> [translate <xyz>] [rotate <axis> <degrees>] [scale <s>]");
+            std::string op;
+            while (line >> op) {
+                bool ok = (op == "translate" && read_vec(k.translation))
+                       || (op == "rotate" && read_vec(k.axis) && (line >> k.degrees) && k.axis.length_squared() > 0)
+                       || (op == "scale" && (line >> k.scale) && k.scale != 0);
+                if (!ok)
+                    return fail("key transforms are translate <xyz>, rotate <axis> <degrees>, scale <s>");
+            }
+            if (keyed < 0)
+                return fail("key must follow an object or another key");
+
+            // The first key puts the object into an instance that moves it.
+            // The instance holds a pointer from the arena, so it lives
+            // outside it (see scene_arena).
+            std::vector<animated_object>& animated = scene.animation.objects;
+            if (animated.empty() || animated.back().placement != scene.world.objects[keyed]) {
+                animated_object object;
+                object.placement = make_shared<instance>(scene.world.objects[keyed], transform());
+                scene.world.objects[keyed] = object.placement;
+                animated.push_back(object);
+            } else if (k.frame <= animated.back().keys.back().frame) {
+                return fail("keys of an object must follow each other with rising frames");
+            }
+            animated.back().keys.push_back(k);
+        } else if (keyword == "material") {
+            std::string name, type;
+            color albedo;
+            if (!(line >> name >> type))
+                return fail("expected: material <name> <type> ...");
+            if (type == "lambertian" && read_vec(albedo)) {
+                named[name] = materials.make<lambertian>(albedo);
+            } else if (type == "metal" && read_vec(albedo)) {
+                double fuzz;
+                if (!(line >> fuzz))
+                    return fail("expected: material <name> metal <r g b> <fuzz>");
+                named[name] = materials.make<metal>(albedo, fuzz);
+            } else if (type == "dielectric") {
+                double ir;
+                if (!(line >> ir) || !read_vec(albedo))
+                    return fail("expected: material <name> dielectric <ior> <r g b>");
+                named[name] = materials.make<dielectric>(ir, albedo);
+            } else if (type == "light" && read_vec(albedo)) {
+                named[name] = materials.make<light>(albedo);
+            } else {
+                return fail("unknown material type or missing color");
+            }
+        } else if (keyword == "sphere") {
+            point3 center;
+            double radius;
+            const material* m;
+            if (!read_vec(center) || !(line >> radius) || !read_material(m))
+                return fail("expected: sphere <center> <radius> <material>");
+            scene.world.add(scene.arena->make<sphere>(center, radius, m));
+        } else if (keyword == "triangle") {
+            point3 a, b, c;
+            const material* m;
+            if (!read_vec(a) || !read_vec(b) || !read_vec(c) || !read_material(m))
+                return fail("expected: triangle <xyz> <xyz> <xyz> <material>");
+            scene.world.add(scene.arena->make<triangle>(a, b, c, m));
+        } else if (keyword == "rectangle") {
+            std::string axis;
+            double k, a0, a1, b0, b1;
+            const material* m;
+            if (!(line >> axis >> k >> a0 >> a1 >> b0 >> b1) || !read_material(m))
+                return fail("expected: rectangle x|y|z <k> <a0 a1> <b0 b1> <material>");
+            if (axis == "x")
+                scene.world.add(scene.arena->make<rectangle>(0, 0, a0, a1, b0, b1, 1, k, m));
+            else if (axis == "y")
+                scene.world.add(scene.arena->make<rectangle>(a0, a1, 0, 0, b0, b1, 2, k, m));
+            else if (axis == "z")
+                scene.world.add(scene.arena->make<rectangle>(a0, a1, b0, b1, 0, 0, 3, k, m));
+            else
+                return fail("rectangle axis must be x, y or z");
+        } else if (keyword == "mesh") {
+            std::string file;
+            const material* m;
+            if (!(line >> file) || !read_material(m))
+                return fail("expected: mesh <file.obj> <material> [transforms]");
+
+            transform to_world;
+            std::string op;
+            while (line >> op) {
+                vec3 v;
+                double s;
+                if (op == "scale" && (line >> s))
+                    to_world = transform::scale(s) * to_world;
+                else if (op == "rotate" && read_vec(v) && (line >> s))
+                    to_world = transform::rotate(v, s) * to_world;
+                else if (op == "translate" && read_vec(v))
+                    to_world = transform::translate(v) * to_world;
+                else
+                    return fail("mesh transforms are scale <s>, rotate <axis> <degrees>, translate <xyz>");
+            }
+
+            std::string obj_path = file[0] == '/' ? file : dir + file;
+            auto start = std::chrono::steady_clock::now();
+            obj_data data;
+            if (!load_obj(obj_path.c_str(), data, threads))
+                return fail("could not load mesh");
+            if (data.indices.empty())
+                return fail("mesh has no faces");
+            std::chrono::duration<double> parse_time = std::chrono::steady_clock::now() - start;
+
+            for (point3& p : data.vertices)
+                p = to_world.apply_point(p);
+            auto mesh = scene.arena->make<triangle_mesh>(std::move(data.vertices), std::move(data.indices), m);
+            std::chrono::duration<double> total_time = std::chrono::steady_clock::now() - start;
+            fprintf(stderr, "Mesh %s: %zu triangles, parsed in %.2f s, ready in %.2f s\n",
+                    obj_path.c_str(), mesh->triangle_count(), parse_time.count(), total_time.count());
+            scene.world.add(mesh);
+        } else {
+            return fail("unknown statement");
+        }
+
+        std::string extra;
+        if (keyword != "mesh" && keyword != "key" && (line >> extra))
+            return fail("unexpected text at end of line");
+
+        if (static_cast<int>(scene.world.objects.size()) > object_count)
+            keyed = object_count;
+    }
+
+    if (scene.world.objects.empty()) {
+        fprintf(stderr, "%s: scene has no objects\n", path);
+        return false;
+    }
+    if (scene.animation.empty() && (!scene.animation.camera_keys.empty() || !scene.animation.objects.empty())) {
+        fprintf(stderr, "%s: keys need a frames statement\n", path);
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Four-wide vectors of real for the leaf intersection kernels. In double
+// precision AVX holds all four lanes in one register and SSE2 uses a pair;
+// in single precision (RT_FLOAT) SSE holds them in one register. Anything
+// else falls back to plain arrays that the compiler may vectorize itself.
+
+#include "rt.h"
+
+#include <cmath>
+
+#if defined(RT_FLOAT) && defined(__SSE__)
+#include <xmmintrin.h>
+#define SIMD_ISA "sse (float)"
+#define SIMD_FLOAT_SSE
+#elif !defined(RT_FLOAT) && defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_ISA "avx"
+#define SIMD_DOUBLE_AVX
+#elif !defined(RT_FLOAT) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_ISA "sse2"
+#define SIMD_DOUBLE_SSE2
+#else
+#define SIMD_ISA "scalar"
+#endif
+
+#if defined(SIMD_FLOAT_SSE)
+
+struct float4 {
+    __m128 v;
+
+    float4() {}
+    float4(__m128 x) : v(x) {}
+    explicit float4(float s) : v(_mm_set1_ps(s)) {}
+
+    static float4 load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+struct mask4 {
+    __m128 v;
+
+    mask4(__m128 x) : v(x) {}
+
+    int bits() const { return _mm_movemask_ps(v); }
+};
+
+inline float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+inline float4 sqrt(float4 a) { return _mm_sqrt_ps(a.v); }
+inline float4 abs(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+
+inline mask4 operator<(float4 a, float4 b)  { return _mm_cmplt_ps(a.v, b.v); }
+inline mask4 operator<=(float4 a, float4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline mask4 operator>(float4 a, float4 b)  { return _mm_cmpgt_ps(a.v, b.v); }
+inline mask4 operator>=(float4 a, float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+inline mask4 operator&(mask4 a, mask4 b) { return _mm_and_ps(a.v, b.v); }
+inline mask4 operator|(mask4 a, mask4 b) { return _mm_or_ps(a.v, b.v); }
+
+// Lanes of a where m is set, b elsewhere.
+inline float4 select(mask4 m, float4 a, float4 b) {
+    return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v));
+}
+
+typedef float4 real4;
+
+#elif defined(SIMD_DOUBLE_AVX)
+
+struct double4 {
+    __m256d v;
+
+    double4() {}
+    double4(__m256d x) : v(x) {}
+    explicit double4(double s) : v(_mm256_set1_pd(s)) {}
+
+    static double4 load(const double* p) { return _mm256_loadu_pd(p); }
+    void store(double* p) const { _mm256_storeu_pd(p, v); }
+};
+
+struct mask4 {
+    __m256d v;
+
+    mask4(__m256d x) : v(x) {}
+
+    int bits() const { return _mm256_movemask_pd(v); }
+};
+
+inline double4 operator+(double4 a, double4 b) { return _mm256_add_pd(a.v, b.v); }
+inline double4 operator-(double4 a, double4 b) { return _mm256_sub_pd(a.v, b.v); }
+inline double4 operator*(double4 a, double4 b) { return _mm256_mul_pd(a.v, b.v); }
+inline double4 operator/(double4 a, double4 b) { return _mm256_div_pd(a.v, b.v); }
+inline double4 sqrt(double4 a) { return _mm256_sqrt_pd(a.v); }
+inline double4 abs(double4 a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v); }
+
+inline mask4 operator<(double4 a, double4 b)  { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+inline mask4 operator<=(double4 a, double4 b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ); }
+inline mask4 operator>(double4 a, double4 b)  { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+inline mask4 operator>=(double4 a, double4 b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ); }
+inline mask4 operator&(mask4 a, mask4 b) { return _mm256_and_pd(a.v, b.v); }
+inline mask4 operator|(mask4 a, mask4 b) { return _mm256_or_pd(a.v, b.v); }
+
+// Lanes of a where m is set, b elsewhere.
+inline double4 select(mask4 m, double4 a, double4 b) { return _mm256_blendv_pd(b.v, a.v, m.v); }
+
+typedef double4 real4;
+
+#elif defined(SIMD_DOUBLE_SSE2)
+
+struct double4 {
+    __m128d lo, hi;
+
+    double4() {}
+    double4(__m128d l, __m128d h) : lo(l), hi(h) {}
+    explicit double4(double s) : lo(_mm_set1_pd(s)), hi(_mm_set1_pd(s)) {}
+
+    static double4 load(const double* p) { return double4(_mm_loadu_pd(p), _mm_loadu_pd(p + 2)); }
+    void store(double* p) const { _mm_storeu_pd(p, lo); _mm_storeu_pd(p + 2, hi); }
+};
+
+struct mask4 {
+    __m128d lo, hi;
+
+    mask4(__m128d l, __m128d h) : lo(l), hi(h) {}
+
+    int bits() const { return _mm_movemask_pd(lo) | (_mm_movemask_pd(hi) << 2); }
+};
+
+inline double4 operator+(double4 a, double4 b) { return double4(_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi)); }
+inline double4 operator-(double4 a, double4 b) { return double4(_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi)); }
+inline double4 operator*(double4 a, double4 b) { return double4(_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi)); }
+inline double4 operator/(double4 a, double4 b) { return double4(_mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi)); }
+inline double4 sqrt(double4 a) { return double4(_mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi)); }
+inline double4 abs(double4 a) {
+    __m128d sign = _mm_set1_pd(-0.0);
+    return double4(_mm_andnot_pd(sign, a.lo), _mm_andnot_pd(sign, a.hi));
+}
+
+inline mask4 operator<(double4 a, double4 b)  { return mask4(_mm_cmplt_pd(a.lo, b.lo), _mm_cmplt_pd(a.hi, b.hi)); }
+inline mask4 operator<=(double4 a, double4 b) { return mask4(_mm_cmple_pd(a.lo, b.lo), _mm_cmple_pd(a.hi, b.hi)); }
+inline mask4 operator>(double4 a, double4 b)  { return mask4(_mm_cmpgt_pd(a.lo, b.lo), _mm_cmpgt_pd(a.hi, b.hi)); }
+inline mask4 operator>=(double4 a, double4 b) { return mask4(_mm_cmpge_pd(a.lo, b.lo), _mm_cmpge_pd(a.hi, b.hi)); }
+inline mask4 operator&(mask4 a, mask4 b) { return mask4(_mm_and_pd(a.lo, b.lo), _mm_and_pd(a.hi, b.hi)); }
+inline mask4 operator|(mask4 a, mask4 b) { return mask4(_mm_or_pd(a.lo, b.lo), _mm_or_pd(a.hi, b.hi)); }
+
+inline double4 select(mask4 m, double4 a, double4 b) {
+    return double4(_mm_or_pd(_mm_and_pd(m.lo, a.lo), _mm_andnot_pd(m.lo, b.lo)),
+                   _mm_or_pd(_mm_and_pd(m.hi, a.hi), _mm_andnot_pd(m.hi, b.hi)));
+}
+
+typedef double4 real4;
+
+#else
+
+struct real4 {
+    real v[4];
+
+    real4() {}
+    explicit real4(real s) : v{s, s, s, s} {}
+
+    static real4 load(const real* p) { real4 r; for (int i = 0; i < 4; i++) r.v[i] = p[i]; return r; }
+    void store(real* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+};
+
+struct mask4 {
+    bool v[4];
+
+    int bits() const { return v[0] | (v[1] << 1) | (v[2] << 2) | (v[3] << 3); }
+};
+
+#define SIMD_LANEWISE(expr) real4 r; for (int i = 0; i < 4; i++) r.v[i] = (expr); return r
+#define SIMD_MASKWISE(expr) mask4 m; for (int i = 0; i < 4; i++) m.v[i] = (expr); return m
+
+inline real4 operator+(real4 a, real4 b) { SIMD_LANEWISE(a.v[i] + b.v[i]); }
+inline real4 operator-(real4 a, real4 b) { SIMD_LANEWISE(a.v[i] - b.v[i]); }
+inline real4 operator*(real4 a, real4 b) { SIMD_LANEWISE(a.v[i] * b.v[i]); }
+inline real4 operator/(real4 a, real4 b) { SIMD_LANEWISE(a.v[i] / b.v[i]); }
+inline real4 sqrt(real4 a) { SIMD_LANEWISE(std::sqrt(a.v[i])); }
+inline real4 abs(real4 a) { SIMD_LANEWISE(std::fabs(a.v[i])); }
+
+inline mask4 operator<(real4 a, real4 b)  { SIMD_MASKWISE(a.v[i] < b.v[i]); }
+inline mask4 operator<=(real4 a, real4 b) { SIMD_MASKWISE(a.v[i] <= b.v[i]); }
+inline mask4 operator>(real4 a, real4 b)  { SIMD_MASKWISE(a.v[i] > b.v[i]); }
+inline mask4 operator>=(real4 a, real4 b) { SIMD_MASKWISE(a.v[i] >= b.v[i]); }
+inline mask4 operator&(mask4 a, mask4 b) { SIMD_MASKWISE(a.v[i] && b.v[i]); }
+inline mask4 operator|(mask4 a, mask4 b) { SIMD_MASKWISE(a.v[i] || b.v[i]); }
+
+inline real4 select(mask4 m, real4 a, real4 b) { SIMD_LANEWISE(m.v[i] ? a.v[i] : b.v[i]); }
+
+#undef SIMD_LANEWISE
+#undef SIMD_MASKWISE
+
+#endif
+
+#endif
@@ -2,24 +2,31 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "stats.h"
 #include "vec3.h"
 
 class sphere : public hittable {
     public:
         sphere() {}
-        sphere(point3 cen, double r, shared_ptr<material> m)
+        sphere(point3 cen, real r, const material* m)
             : center(cen), radius(r), mat_ptr(m) {};
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
+
+        // Nearest root of r in [t_min, t_max], if any.
+        bool intersect(const ray& r, real t_min, real t_max, real& root) const;
 
     public:
         point3 center;
-        double radius;
-        shared_ptr<material> mat_ptr;
+        real radius;
+        const material* mat_ptr;
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool sphere::intersect(const ray& r, real t_min, real t_max, real& root) const {
+    STAT(stat_tests(stat_primitive::sphere, 1));
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -30,12 +37,19 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     auto sqrtd = sqrt(discriminant);
 
     // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
     if (root < t_min || t_max < root) {
         root = (-half_b + sqrtd) / a;
         if (root < t_min || t_max < root)
             return false;
     }
+    return true;
+}
+
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    real root;
+    if (!intersect(r, t_min, t_max, root))
+        return false;
 
     rec.t = root;
     rec.p = r.at(rec.t);
@@ -46,4 +60,15 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     return true;
 }
 
+bool sphere::occluded(const ray& r, real t_min, real t_max) const {
+    real root;
+    return intersect(r, t_min, t_max, root);
+}
+
+bool sphere::bounding_box(aabb& output_box) const {
+    vec3 extent(radius, radius, radius);
+    output_box = aabb(center - extent, center + extent);
+    return true;
+}
+
 #endif
\ No newline at end of file
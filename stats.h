@@ -0,0 +1,199 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "rt.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+// Render statistics, compiled in with -DRT_STATS (make STATS=1). Counters are
+// bumped through STAT() in the primitives, the traversal and the
+// integrators, so a normal build carries no trace of them.
+#ifdef RT_STATS
+#define STAT(statement) statement
+#else
+#define STAT(statement)
+#endif
+
+// Primitive kernels counted separately; the SIMD blocks count one test per
+// primitive they hold.
+enum class stat_primitive { sphere, triangle, rectangle, mesh_triangle };
+const int stat_primitive_kinds = 4;
+
+// Matches material_kind.
+const int stat_material_kinds = 5;
+
+// Rays per camera sample, with longer samples in the last bucket.
+const int stat_max_path_length = 64;
+
+struct render_stats {
+    render_stats()
+        : camera_rays(0), secondary_rays(), shadow_rays(0), primitive_tests(), node_visits(0), path_length(),
+          ended_escaped(0), ended_absorbed(0), ended_depth(0), ended_cutoff(0), ended_roulette(0) {}
+
+    uint64_t camera_rays;
+    uint64_t secondary_rays[stat_material_kinds];   // scattered, by material
+    uint64_t shadow_rays;                           // toward sampled lights
+    uint64_t primitive_tests[stat_primitive_kinds];
+    uint64_t node_visits;
+    uint64_t path_length[stat_max_path_length + 1];
+
+    // How paths (for the split integrator, branches) ended.
+    uint64_t ended_escaped;     // left the scene
+    uint64_t ended_absorbed;    // hit something that scattered nothing
+    uint64_t ended_depth;       // reached max_depth
+    uint64_t ended_cutoff;      // attenuation fell below the cutoff of ray_color
+    uint64_t ended_roulette;    // ended by Russian roulette
+
+    // Traversal work: node visits plus primitive tests.
+    uint64_t work() const {
+        uint64_t total = node_visits;
+        for (int k = 0; k < stat_primitive_kinds; ++k)
+            total += primitive_tests[k];
+        return total;
+    }
+
+    void add(const render_stats& other);
+    void print(FILE* out) const;
+};
+
+// Counters of the calling thread; render_tile_blocks() folds them into
+// total_stats as each worker finishes.
+thread_local render_stats thread_stats;
+render_stats total_stats;
+std::mutex total_stats_lock;
+
+inline void merge_thread_stats() {
+    std::lock_guard<std::mutex> guard(total_stats_lock);
+    total_stats.add(thread_stats);
+    thread_stats = render_stats();
+}
+
+inline void stat_tests(stat_primitive kind, uint64_t count) {
+    thread_stats.primitive_tests[static_cast<int>(kind)] += count;
+}
+
+inline void stat_path_length(uint64_t rays) {
+    thread_stats.path_length[std::min<uint64_t>(rays, stat_max_path_length)]++;
+}
+
+void render_stats::add(const render_stats& other) {
+    camera_rays += other.camera_rays;
+    for (int k = 0; k < stat_material_kinds; ++k)
+        secondary_rays[k] += other.secondary_rays[k];
+    shadow_rays += other.shadow_rays;
+    for (int k = 0; k < stat_primitive_kinds; ++k)
+        primitive_tests[k] += other.primitive_tests[k];
+    node_visits += other.node_visits;
+    for (int k = 0; k <= stat_max_path_length; ++k)
+        path_length[k] += other.path_length[k];
+    ended_escaped += other.ended_escaped;
+    ended_absorbed += other.ended_absorbed;
+    ended_depth += other.ended_depth;
+    ended_cutoff += other.ended_cutoff;
+    ended_roulette += other.ended_roulette;
+}
+
+void render_stats::print(FILE* out) const {
+    static const char* materials[stat_material_kinds] = { "lambertian", "metal", "dielectric", "light", "other" };
+    static const char* primitives[stat_primitive_kinds] = { "sphere", "triangle", "rectangle", "mesh triangle" };
+
+    uint64_t secondary = 0, tests = 0, paths = 0, path_rays = 0;
+    for (int k = 0; k < stat_material_kinds; ++k)
+        secondary += secondary_rays[k];
+    for (int k = 0; k < stat_primitive_kinds; ++k)
+        tests += primitive_tests[k];
+    for (int k = 0; k <= stat_max_path_length; ++k) {
+        paths += path_length[k];
+        path_rays += k * path_length[k];
+    }
+    // Rays scattered at the last bounce, or too weak to follow, are not traced.
+    uint64_t traced = camera_rays + secondary + shadow_rays - ended_depth - ended_cutoff;
+    double rays = std::max<uint64_t>(1, traced);
+    auto percent = [](uint64_t part, uint64_t whole) { return whole ? 100.0 * part / whole : 0.0; };
+
+    fprintf(out, "Render statistics:\n");
+    fprintf(out, "  camera rays       %14llu\n", static_cast<unsigned long long>(camera_rays));
+    fprintf(out, "  scattered rays    %14llu\n", static_cast<unsigned long long>(secondary));
+    for (int k = 0; k < stat_material_kinds; ++k)
+        if (secondary_rays[k])
+            fprintf(out, "    from %-12s %12llu  %5.1f%%\n", materials[k],
+                    static_cast<unsigned long long>(secondary_rays[k]), percent(secondary_rays[k], secondary));
+    if (shadow_rays)
+        fprintf(out, "  shadow rays       %14llu\n", static_cast<unsigned long long>(shadow_rays));
+    fprintf(out, "  rays traced       %14llu\n", static_cast<unsigned long long>(traced));
+    fprintf(out, "  node visits       %14llu  %8.2f per ray\n",
+            static_cast<unsigned long long>(node_visits), node_visits / rays);
+    fprintf(out, "  primitive tests   %14llu  %8.2f per ray\n", static_cast<unsigned long long>(tests), tests / rays);
+    for (int k = 0; k < stat_primitive_kinds; ++k)
+        if (primitive_tests[k])
+            fprintf(out, "    %-17s %12llu  %5.1f%%\n", primitives[k],
+                    static_cast<unsigned long long>(primitive_tests[k]), percent(primitive_tests[k], tests));
+
+    uint64_t ended = ended_escaped + ended_absorbed + ended_depth + ended_cutoff + ended_roulette;
+    fprintf(out, "  paths ended       %14llu\n", static_cast<unsigned long long>(ended));
+    const char* reasons[5] = { "escaped", "absorbed", "max depth", "cutoff", "roulette" };
+    const uint64_t counts[5] = { ended_escaped, ended_absorbed, ended_depth, ended_cutoff, ended_roulette };
+    for (int k = 0; k < 5; ++k)
+        if (counts[k])
+            fprintf(out, "    %-17s %12llu  %5.1f%%\n", reasons[k],
+                    static_cast<unsigned long long>(counts[k]), percent(counts[k], ended));
+
+    if (paths) {
+        fprintf(out, "  rays per sample   %14.2f mean\n", double(path_rays) / paths);
+        for (int k = 0; k <= stat_max_path_length; ++k)
+            if (path_length[k])
+                fprintf(out, "    %2d%s %12llu  %5.1f%%\n", k, k == stat_max_path_length ? "+" : " ",
+                        static_cast<unsigned long long>(path_length[k]), percent(path_length[k], paths));
+    }
+}
+
+// Traversal work per pixel, summed over every pass that renders it. Empty
+// unless start_cost_map() was called.
+struct cost_map {
+    cost_map() : width(0) {}
+
+    int width;
+    std::vector<uint64_t> work;
+};
+cost_map pixel_cost;
+
+inline void start_cost_map(int width, int height) {
+    pixel_cost.width = width;
+    pixel_cost.work.assign(static_cast<size_t>(width) * height, 0);
+}
+
+inline void stat_pixel_cost(int i, int j, uint64_t work) {
+    if (!pixel_cost.work.empty())
+        pixel_cost.work[static_cast<size_t>(j) * pixel_cost.width + i] += work;
+}
+
+// Writes the cost map as a P3 heatmap, from black through red and yellow to
+// white, on a log scale up to the most expensive pixel.
+bool write_cost_map(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out)
+        return false;
+
+    int width = pixel_cost.width;
+    int height = width ? static_cast<int>(pixel_cost.work.size() / width) : 0;
+    uint64_t busiest = pixel_cost.work.empty() ? 0 : *std::max_element(pixel_cost.work.begin(), pixel_cost.work.end());
+    double scale = 1.0 / log1p(static_cast<double>(std::max<uint64_t>(1, busiest)));
+
+    fprintf(out, "P3\n%d %d\n255\n", width, height);
+    for (int j = height-1; j >= 0; --j) {
+        for (int i = 0; i < width; ++i) {
+            double x = log1p(static_cast<double>(pixel_cost.work[static_cast<size_t>(j) * width + i])) * scale;
+            int r = static_cast<int>(255 * clamp(3*x, 0, 1));
+            int g = static_cast<int>(255 * clamp(3*x - 1, 0, 1));
+            int b = static_cast<int>(255 * clamp(3*x - 2, 0, 1));
+            fprintf(out, "%d %d %d\n", r, g, b);
+        }
+    }
+    return fclose(out) == 0;
+}
+
+#endif
@@ -2,64 +2,71 @@
 #define TRIANGLE_H
 
 #include "hittable.h"
+#include "stats.h"
 #include "vec3.h"
 
 class triangle : public hittable {
     public:
         triangle() {}
-        //triangle(point3 cen, double r, shared_ptr<material> m)
+        //triangle(point3 cen, real r, shared_ptr<material> m)
         //    : center(cen), radius(r), mat_ptr(m) {};
-	    triangle(point3 p1, point3 p2, point3 p3, shared_ptr<material> m)
+	    triangle(point3 p1, point3 p2, point3 p3, const material* m)
 		    : vertex{p1, p2, p3}, mat_ptr(m) {};
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
 
-        double deter(double x00, double x01, double x02, double x10, double x11, double x12, double x20, double x21, double x22) const;
+        // Distance t along r to the triangle, if it lies in [t_min, t_max].
+        bool intersect(const ray& r, real t_min, real t_max, real& t) const;
+
+        real deter(real x00, real x01, real x02, real x10, real x11, real x12, real x20, real x21, real x22) const;
 
     public:
         //point3 center;
-        //double radius;
+        //real radius;
         point3 vertex[3];
-    	shared_ptr<material> mat_ptr;
+    	const material* mat_ptr;
 };
 
-double triangle::deter(double x00, double x01, double x02, double x10, double x11, double x12, double x20, double x21, double x22) const {
+real triangle::deter(real x00, real x01, real x02, real x10, real x11, real x12, real x20, real x21, real x22) const {
     return x00*x11*x22 + x01*x12*x20 + x02*x10*x21 - x00*x12*x21 - x01*x10*x22 - x02*x11*x20;
 }
 
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    bool found_t = false;
-    vec3 outward_normal;
-
+bool triangle::intersect(const ray& r, real t_min, real t_max, real& t) const {
+    STAT(stat_tests(stat_primitive::triangle, 1));
     vec3 v1 = vertex[2] - vertex[0], v2 = vertex[1] - vertex[0];
 
-    // double a, b, t; 
+    // real a, b, t; 
     // r.orig + t*r.dir = vertex[0] + a*v1 + b*v2
     // a*v1 + b*v2 + t*(-r.dir) = r.orig - vertex[0];
-    double delta  = deter(v1[0], v2[0], -r.dir[0], v1[1], v2[1], -r.dir[1], v1[2], v2[2], -r.dir[2]);
+    real delta  = deter(v1[0], v2[0], -r.dir[0], v1[1], v2[1], -r.dir[1], v1[2], v2[2], -r.dir[2]);
     
-    if(abs(delta) <= 10e-8) {
+    real delta_limit = det_epsilon*det_epsilon * v1.length_squared() * v2.length_squared() * r.dir.length_squared();
+    if(delta*delta <= delta_limit) {
         return false;
     }
     
-    double delta_a = deter(r.orig[0] - vertex[0][0], v2[0], -r.dir[0], r.orig[1] - vertex[0][1], v2[1], -r.dir[1], r.orig[2]-vertex[0][2], v2[2], -r.dir[2]);
-    double delta_b = deter(v1[0], r.orig[0] - vertex[0][0], -r.dir[0], v1[1], r.orig[1] - vertex[0][1], -r.dir[1], v1[2], r.orig[2]-vertex[0][2], -r.dir[2]);
-    double delta_t = deter(v1[0], v2[0], r.orig[0] - vertex[0][0], v1[1], v2[1], r.orig[1] - vertex[0][1], v1[2], v2[2], r.orig[2]-vertex[0][2]);
-
-    double a = delta_a/delta;
-    double b = delta_b/delta;
-    double t = delta_t/delta;
-
-    if(a >= 0 && b >= 0 && a+b <= 1 && t_min <= t && t <= t_max) {
-        found_t = true;
-        outward_normal = cross(v1, v2);
-        if(dot(outward_normal, r.direction()) > 0)
-            outward_normal *= -1;
-    }
+    real delta_a = deter(r.orig[0] - vertex[0][0], v2[0], -r.dir[0], r.orig[1] - vertex[0][1], v2[1], -r.dir[1], r.orig[2]-vertex[0][2], v2[2], -r.dir[2]);
+    real delta_b = deter(v1[0], r.orig[0] - vertex[0][0], -r.dir[0], v1[1], r.orig[1] - vertex[0][1], -r.dir[1], v1[2], r.orig[2]-vertex[0][2], -r.dir[2]);
+    real delta_t = deter(v1[0], v2[0], r.orig[0] - vertex[0][0], v1[1], v2[1], r.orig[1] - vertex[0][1], v1[2], v2[2], r.orig[2]-vertex[0][2]);
+
+    real a = delta_a/delta;
+    real b = delta_b/delta;
+    t = delta_t/delta;
 
-    if(!found_t)
+    return a >= 0 && b >= 0 && a+b <= 1 && t_min <= t && t <= t_max;
+}
+
+bool triangle::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    real t;
+    if(!intersect(r, t_min, t_max, t))
         return false;
     //fprintf(stderr, "succeed to hit triangle\n");
+
+    vec3 outward_normal = cross(vertex[2] - vertex[0], vertex[1] - vertex[0]);
+    if(dot(outward_normal, r.direction()) > 0)
+        outward_normal *= -1;
 	
     rec.t = t;
     rec.p = r.at(rec.t);
@@ -69,5 +76,25 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     return true;
 }
 
+bool triangle::occluded(const ray& r, real t_min, real t_max) const {
+    real t;
+    return intersect(r, t_min, t_max, t);
+}
+
+bool triangle::bounding_box(aabb& output_box) const {
+    output_box = aabb();
+    for (int i = 0; i < 3; i++)
+        output_box.expand(vertex[i]);
+
+    // Pad axis-aligned triangles so the box never has zero thickness.
+    for (int a = 0; a < 3; a++) {
+        if (output_box.maximum[a] - output_box.minimum[a] < 1e-4) {
+            output_box.minimum[a] -= 0.5e-4;
+            output_box.maximum[a] += 0.5e-4;
+        }
+    }
+    return true;
+}
+
 
 #endif
\ No newline at end of file
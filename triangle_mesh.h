@@ -0,0 +1,202 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "rt.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "stats.h"
+
+#include <cstdint>
+#include <vector>
+
+// An indexed triangle mesh answering ray queries as a single object. Vertices
+// live in one shared array and each triangle costs three 32-bit indices plus
+// its two precomputed edge vectors; an internal bvh orders the triangles so
+// that a leaf's data is contiguous in memory.
+// Triangles are wound counter-clockwise around their outward normal.
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh() {}
+        triangle_mesh(std::vector<point3> verts, std::vector<uint32_t> tri_indices, const material* m);
+
+        size_t triangle_count() const { return indices.size() / 3; }
+        size_t memory_usage() const;
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual int occluded_packet(const ray_packet& packet, real t_min, int active) const override;
+        virtual bool bounding_box(aabb& output_box) const override;
+
+    private:
+        bool intersect(const ray& r, int k, real& t) const;
+        bool occluded_leaf(const ray& r, int first, int count, real t_min, real t_max) const;
+        bool hit_leaf(const ray& r, int first, int count, real t_min, real& closest, int& best) const;
+        void fill_record(const ray& r, real t, int best, hit_record& rec) const;
+
+    public:
+        std::vector<point3> vertices;
+        std::vector<uint32_t> indices;  // three per triangle, in leaf order
+        std::vector<vec3> edges;        // vertex[1] - vertex[0], vertex[2] - vertex[0]
+        std::vector<real> det_limits;   // (det_epsilon |e1| |e2|)^2
+        std::vector<bvh_node> nodes;
+        const material* mat_ptr;
+};
+
+triangle_mesh::triangle_mesh(std::vector<point3> verts, std::vector<uint32_t> tri_indices, const material* m)
+    : mat_ptr(m)
+{
+    vertices.swap(verts);
+
+    size_t n = tri_indices.size() / 3;
+    std::vector<aabb> boxes(n);
+    for (size_t k = 0; k < n; k++) {
+        for (int i = 0; i < 3; i++)
+            boxes[k].expand(vertices[tri_indices[3*k + i]]);
+    }
+
+    std::vector<int> order;
+    nodes = bvh_builder(4).build(boxes, order);
+
+    indices.resize(3 * n);
+    edges.resize(2 * n);
+    det_limits.resize(n);
+    for (size_t k = 0; k < n; k++) {
+        const uint32_t* src = &tri_indices[3 * order[k]];
+        for (int i = 0; i < 3; i++)
+            indices[3*k + i] = src[i];
+        edges[2*k] = vertices[src[1]] - vertices[src[0]];
+        edges[2*k + 1] = vertices[src[2]] - vertices[src[0]];
+        det_limits[k] = det_epsilon*det_epsilon * edges[2*k].length_squared() * edges[2*k + 1].length_squared();
+    }
+}
+
+size_t triangle_mesh::memory_usage() const {
+    return vertices.capacity() * sizeof(point3)
+         + indices.capacity() * sizeof(uint32_t)
+         + edges.capacity() * sizeof(vec3)
+         + det_limits.capacity() * sizeof(real)
+         + nodes.capacity() * sizeof(bvh_node);
+}
+
+// Moller-Trumbore with the edges precomputed: true if r meets triangle k,
+// at distance t along it.
+inline bool triangle_mesh::intersect(const ray& r, int k, real& t) const {
+    const vec3& dir = r.direction();
+    const vec3& e1 = edges[2*k];
+    const vec3& e2 = edges[2*k + 1];
+    vec3 pvec = cross(dir, e2);
+    real det = dot(e1, pvec);
+    if (det*det <= det_limits[k] * dir.length_squared())
+        return false;
+    real inv_det = 1.0 / det;
+
+    vec3 tvec = r.origin() - vertices[indices[3*k]];
+    real u = dot(tvec, pvec) * inv_det;
+    if (u < 0 || u > 1)
+        return false;
+    vec3 qvec = cross(tvec, e1);
+    real v = dot(dir, qvec) * inv_det;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = dot(e2, qvec) * inv_det;
+    return true;
+}
+
+// Tests r against triangles [first, first + count), lowering closest to the
+// nearest hit and setting best to its triangle.
+bool triangle_mesh::hit_leaf(const ray& r, int first, int count, real t_min, real& closest, int& best) const {
+    STAT(stat_tests(stat_primitive::mesh_triangle, count));
+    bool hit_anything = false;
+    for (int k = first; k < first + count; k++) {
+        real t;
+        if (!intersect(r, k, t) || t < t_min || t > closest)
+            continue;
+
+        closest = t;
+        best = k;
+        hit_anything = true;
+    }
+    return hit_anything;
+}
+
+// Whether r meets any of triangles [first, first + count) between t_min and
+// t_max, stopping at the first that it does.
+bool triangle_mesh::occluded_leaf(const ray& r, int first, int count, real t_min, real t_max) const {
+    for (int k = first; k < first + count; k++) {
+        real t;
+        if (intersect(r, k, t) && t >= t_min && t <= t_max) {
+            STAT(stat_tests(stat_primitive::mesh_triangle, k - first + 1));
+            return true;
+        }
+    }
+    STAT(stat_tests(stat_primitive::mesh_triangle, count));
+    return false;
+}
+
+void triangle_mesh::fill_record(const ray& r, real t, int best, hit_record& rec) const {
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, unit_vector(cross(edges[2*best], edges[2*best + 1])));
+    rec.mat_ptr = mat_ptr;
+}
+
+bool triangle_mesh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    int best = -1;
+    real best_t = 0;
+    bool hit_anything = bvh_traverse(nodes, r, t_min, t_max, [&](int first, int count, real& closest) {
+        if (!hit_leaf(r, first, count, t_min, closest, best))
+            return false;
+        best_t = closest;
+        return true;
+    });
+
+    if (!hit_anything)
+        return false;
+
+    fill_record(r, best_t, best, rec);
+    return true;
+}
+
+int triangle_mesh::hit_packet(ray_packet& packet, real t_min, hit_record* recs, int active) const {
+    int best[max_packet_size];
+    int hits = bvh_traverse_packet(nodes, packet, t_min, active, [&](int rays, int first, int count) {
+        int leaf_hits = 0;
+        for (int k = 0; k < packet.count; k++)
+            if (((rays >> k) & 1) && hit_leaf(packet.rays[k], first, count, t_min, packet.t_max[k], best[k]))
+                leaf_hits |= 1 << k;
+        return leaf_hits;
+    });
+
+    for (int k = 0; k < packet.count; k++)
+        if ((hits >> k) & 1)
+            fill_record(packet.rays[k], packet.t_max[k], best[k], recs[k]);
+    return hits;
+}
+
+bool triangle_mesh::occluded(const ray& r, real t_min, real t_max) const {
+    return bvh_occluded(nodes, r, t_min, t_max, [&](int first, int count) {
+        return occluded_leaf(r, first, count, t_min, t_max);
+    });
+}
+
+int triangle_mesh::occluded_packet(const ray_packet& packet, real t_min, int active) const {
+    return bvh_occluded_packet(nodes, packet, t_min, active, [&](int rays, int first, int count) {
+        int blocked = 0;
+        for (int k = 0; k < packet.count; k++)
+            if (((rays >> k) & 1) && occluded_leaf(packet.rays[k], first, count, t_min, packet.t_max[k]))
+                blocked |= 1 << k;
+        return blocked;
+    });
+}
+
+bool triangle_mesh::bounding_box(aabb& output_box) const {
+    if (nodes.empty())
+        return false;
+    output_box = nodes[0].box;
+    return true;
+}
+
+#endif
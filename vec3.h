@@ -10,15 +10,15 @@ using std::fabs;
 class vec3 {
     public:
         vec3() : e{0,0,0} {}
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        real x() const { return e[0]; }
+        real y() const { return e[1]; }
+        real z() const { return e[2]; }
 
         vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-        double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
+        real operator[](int i) const { return e[i]; }
+        real& operator[](int i) { return e[i]; }
 
         vec3& operator+=(const vec3 &v) {
             e[0] += v.e[0];
@@ -27,22 +27,22 @@ class vec3 {
             return *this;
         }
 
-        vec3& operator*=(const double t) {
+        vec3& operator*=(const real t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
 
-        vec3& operator/=(const double t) {
+        vec3& operator/=(const real t) {
             return *this *= 1/t;
         }
 
-        double length() const {
+        real length() const {
             return sqrt(length_squared());
         }
 
-        double length_squared() const {
+        real length_squared() const {
             return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
         }
 
@@ -52,16 +52,16 @@ class vec3 {
             return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
         }
 
-        inline static vec3 random() {
-            return vec3(random_double(), random_double(), random_double());
+        inline static vec3 random(rng& gen) {
+            return vec3(random_double(gen), random_double(gen), random_double(gen));
         }
 
-        inline static vec3 random(double min, double max) {
-            return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+        inline static vec3 random(rng& gen, real min, real max) {
+            return vec3(random_double(gen,min,max), random_double(gen,min,max), random_double(gen,min,max));
         }
 
     public:
-        double e[3];
+        real e[3];
 };
 
 
@@ -88,19 +88,19 @@ inline vec3 operator*(const vec3 &u, const vec3 &v) {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3 &v) {
+inline vec3 operator*(real t, const vec3 &v) {
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &v, double t) {
+inline vec3 operator*(const vec3 &v, real t) {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+inline vec3 operator/(vec3 v, real t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3 &v) {
+inline real dot(const vec3 &u, const vec3 &v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
@@ -116,28 +116,46 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
+// The samplers below map uniform numbers in closed form, without rejection,
+// so that each draws a fixed number of them and low-discrepancy numbers keep
+// their stratification (see rng).
+
+// Uniform point in the unit disk, by the concentric mapping of Shirley and
+// Chiu from the square [-1,1]^2.
+inline vec3 random_in_unit_disk(rng& gen) {
+    double a = random_double(gen, -1, 1);
+    double b = random_double(gen, -1, 1);
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+    double r, phi;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        phi = (pi/4) * (b/a);
+    } else {
+        r = b;
+        phi = pi/2 - (pi/4) * (a/b);
     }
+    return vec3(r*cos(phi), r*sin(phi), 0);
 }
 
-inline vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+// Uniform direction: height uniform in [-1,1] and azimuth uniform, which
+// covers the sphere evenly (Archimedes' hat-box theorem).
+inline vec3 random_unit_vector(rng& gen) {
+    double z = 1 - 2*random_double(gen);
+    double r = sqrt(fmax(0.0, 1 - z*z));
+    double phi = 2*pi*random_double(gen);
+    return vec3(r*cos(phi), r*sin(phi), z);
 }
 
-inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+// Uniform point in the unit ball: a uniform direction at a distance whose
+// cube is uniform.
+inline vec3 random_in_unit_sphere(rng& gen) {
+    vec3 direction = random_unit_vector(gen);
+    return cbrt(random_double(gen)) * direction;
 }
 
-inline vec3 random_in_hemisphere(const vec3& normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
+inline vec3 random_in_hemisphere(const vec3& normal, rng& gen) {
+    vec3 in_unit_sphere = random_in_unit_sphere(gen);
     if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
@@ -148,7 +166,7 @@ inline vec3 reflect(const vec3 &v, const vec3 &n) {
     return v - 2*dot(v,n)*n;
 }
 
-inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat) {
+inline vec3 refract(const vec3 &uv, const vec3 &n, real etai_over_etat) {
     auto cos_theta = fmin(dot(-uv, n), 1.0);
     vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);
     vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;